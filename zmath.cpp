@@ -1,6 +1,8 @@
 /*
 
-If you're using the GCC compiler, this code should be built with the -std=c++0x or -std=c++11 flag. I don't know how other compilers work.
+If you're using the GCC compiler, this code should be built with the -std=c++14 flag (or anything newer), and -pthread. I don't know how other compilers work.
+It needs a POSIX system, for mmap. On Linux, growing the sieve moves its pages with mremap instead of copying them.
+    Elsewhere (macOS and the BSDs don't have mremap), every time the sieve outgrows its mapping, it's copied into a new one twice the size.
 The -O2 or -O3 flag significantly speeds up execution, by a factor of 4 with 32-bit numbers, and a factor of 2 with 64-bit numbers.
 
 On my computer, using buildSieveTo(n), it generate primes up to:
@@ -10,8 +12,32 @@ On my computer, using buildSieveTo(n), it generate primes up to:
     in:                     10.3 seconds    22.2 seconds    51.0 seconds    61.8 seconds    145 seconds     232 seconds
     with the -O3 flag:      2.6 seconds     5.5 seconds     12.8 seconds    17.8 seconds    56.4 seconds    96.8 seconds
 
-    At 15.5 billion it throws std::length_error  --  what():  vector<bool>::_M_fill_insert.
-    At 26.7 billion it just fails.
+    Those times are from when the sieve was a std::vector<bool>, which threw std::length_error at 15.5 billion.
+    The sieve is now a plain array of 64-bit words, 720 bytes per 30030 numbers,
+    so it only runs out when memory does, at around 45 billion per gigabyte.
+To get this table (and the times for everything else) on your own computer, build and run zmath_bench.cpp, which prints them as JSON.
+
+The sieve is crossed off in segments of 32 wheel periods (about 1 million numbers, 23 KB of sieve) at a time,
+    so each base prime only touches the part of the sieve that is in cache, instead of walking the whole thing.
+    Only the primes up to sqrt(n) are kept around between segments, along with where each one left off.
+    The primes from 17 to 61 aren't crossed off at all. Their multiples repeat every p wheel periods, so each segment starts out
+    as a copy of those patterns ANDed together, which takes about 30% off buildSieveTo(1000000000).
+
+By default everything runs on one thread. Call setThreads(t) to sieve and count with t threads instead,
+    or setThreads(0) to use one per core. The range is split into chunks of whole segments, which are handed out to the threads,
+    and each chunk works out where the base primes start on its own, so the result doesn't depend on the number of threads.
+    This speeds up buildSieveTo, numPrimesUpTo, and anything else that has to extend the sieve.
+
+To find out where the time goes, build with -DZMATH_STATS. Then stats() returns a PrimeStats with how many times each group of
+    functions was called, how many times the sieve was extended or moved, how many bits were crossed off, the nanoseconds spent
+    finding base primes, crossing off, and decoding, and the memory held by the sieve and the rank index. stats().print(stdout) lists them all,
+    and resetStats() starts over. On Linux, enableHardwareCounters() adds the cache and branch misses in those phases, from perf_event_open,
+    if the kernel allows it (see /proc/sys/kernel/perf_event_paranoid). Without ZMATH_STATS, none of this is compiled in.
+
+Example:
+    PrimeData pd;
+    pd.buildSieveTo(1000000000);
+    std::cout<<pd.stats()[SieveExtensions]<<' '<<pd.stats()[BitsCrossedOff]<<std::endl;
 
 
 
@@ -22,14 +48,72 @@ The most efficient way to use this class, if you are making multiple function ca
     Initialize it and then immediately call buildSieveTo(n), when you know that you won't need any primes above n,
     and then use [Unsafe] versions of the functions.
 Keep in mind that the factor function only needs primes up to sqrt(n) in the worst case (where n is prime or the square of a prime).
-The [Wheel] versions of functions do not need the sieve at all.
+The [Wheel] versions of functions do not need the sieve at all. Below 2^16 they test divisibility by multiplying by a precomputed inverse,
+    so isPrimeSmallWheel and factorSmallWheel never actually divide. They test 16 numbers at a time with AVX-512, or 8 with AVX2,
+    when the processor has it, which makes isPrimeSmallWheel take about 170 ns near 2^32, instead of 540 ns one at a time.
+
+If you just directly call the functions, they will sieve up to whatever they need at the moment.
+When they have to extend the sieve, they at least double it, so calling them with increasing inputs only sieves a handful of times.
+On Linux, growing the sieve never copies the part that is already there, either; the new words are mapped in after it.
+
+If running out of memory isn't an option, call setMemoryLimit(bytes). The sieve, the rank index, sieveRange windows, and the vectors
+    and PrimeLists that primesUpTo, primesInRange, and firstPrimes fill all stay under it, and nothing throws once it's reached:
+    buildSieveTo(n) (and buildRankIndex) return false, after going as far as the limit allows, instead of allocating past it.
+    Functions that only need the sieve up to sqrt(n) sieve the rest in windows, and if even that doesn't fit,
+    they test (or factor) one number at a time, which takes no memory, but is a lot slower.
+    primesUpTo and the rest stop early, at about the last prime that fits, and sieveRange returns a window with a smaller hi().
+lastStrategy() says which of those the last call did: StoredSieve, WindowedSieve, PrimalityTests, or PartialResult.
+isPrime and factor never needed more than a small sieve, so they aren't affected.
+
+Example:
+    PrimeData pd;
+    pd.setMemoryLimit(100000000);
+    std::vector<unsigned long long> primes;
+    pd.primesUpTo(10000000000,primes);
+    if(pd.lastStrategy()==PrimeData::PartialResult)
+        std::cout<<"only got up to "<<primes.back()<<std::endl;
+
+The sieve always comes out the same, so it can be saved to a file with saveSieve(path) and loaded back with loadSieve(path).
+Loading maps the file into memory instead of reading it, so it takes under a millisecond even for a sieve past 4289995710,
+    and programs that load the same file at the same time share one copy of it in memory.
+loadSieve returns false, and doesn't change anything, if the file is missing, cut short, from a different version of this code,
+    or doesn't go any further than the sieve that's already there.
+The easiest way to use it is buildSieveTo(n,path), which loads the file if it's any good, sieves the rest of the way to n,
+    and saves it back to the file if it had to sieve anything. The first run is as slow as usual, and every run after that is instant.
+The file takes about as much space as the sieve, 720 bytes per 30030 numbers.
+
+Example:
+    PrimeData pd;
+    pd.buildSieveTo(4289995710,"primes.sieve");
+
 
-If you just directly call the functions, they will only sieve up to whatever they need at the moment.
-If you are calling them with increasing inputs, this will sieve a whole bunch of times, a little bit at a time, which is super slow.
+A PrimeData can't be shared between threads, since any of the functions might grow the sieve while another thread is reading it.
+To share one sieve, hand a PrimeData over to a ConcurrentPrimeData, which has the same query functions, except for the [Unsafe] and [Wheel] versions,
+    and call them from any thread. ([Wheel] doesn't need a sieve, so any PrimeData will do for that.)
+    Queries read a published PrimeData that never changes again, without taking any locks.
+    When a query needs more sieve than that, one thread copies it, grows the copy to at least twice the size, and publishes the copy,
+    while the other threads carry on with the old one.
+    The old ones are kept until the ConcurrentPrimeData is destroyed, or until you call reclaim() at a moment when no queries are running,
+    so expect up to twice the memory of the sieve itself if it grows a lot. Build it to what you need up front to avoid that.
+
+Example:
+    PrimeData pd;
+    pd.buildSieveTo(4289995710,"primes.sieve");
+    pd.buildRankIndex();
+    ConcurrentPrimeData shared(std::move(pd));
+    // then, on every thread:
+    shared.numPrimesUpTo(1000000000);
 
 
 
 The most robust way to test a prime is to use isPrime(n).
+If the sieve already goes up to n, it just looks n up. Otherwise it doesn't build the sieve,
+    it runs the Miller-Rabin test with the bases 2, 7, and 61 below 4759123141, or the Baillie-PSW test above that,
+    using Montgomery multiplication. Both are exact for every 64-bit number. The bases (or the base 2 test and the Lucas test) run side by side,
+    since each one is a chain of multiplications that has to wait for the last one, so a prime costs about as much as one chain.
+    Measured with -O2 on one core of an Intel Xeon virtual machine, where one of those multiplications takes about 6 ns,
+    a 64-bit prime takes 690 to 760 ns, a prime near 2^31 takes about 440 ns, and a random odd 64-bit number takes about 260 ns.
+    That's under a microsecond, but not well under it: the two chains are about 64 multiplications long each, so it can't go much lower this way.
 However, if you are testing a lot of primes, one at a time, some optimizations are included.
 The general format is isPrime[Small][Unsafe/Wheel](n). (Don't include the brackets.)
 
@@ -54,6 +138,11 @@ Example:
     PrimeData pd;
     std::cout<<pd.isPrimeSmallWheel(999999937)<<std::endl;
 
+If you have a lot of numbers to test at once, isPrimeBatch(in,n,out) (or isPrimeSmallBatch) sets out[i] to isPrime(in[i]).
+    It prefetches the sieve for 64 numbers before it reads any of them, so with a sieve much bigger than the cache,
+    random numbers take about 11 nanoseconds each instead of 18. Pass true as a fourth argument to look them up in sieve order instead,
+    which is only faster when there are more numbers than the sieve has 64-byte lines.
+
 
 
 To prime factor a number, use factor(n,x,y), where x and y are arrays to store factors and exponents, respectively.
@@ -74,10 +163,14 @@ If you use [Small],
     x must be an array of unsigned int (not unsigned long long), with size at least 9.
     y must be an array of unsigned char, with size at least 9.
 [Wheel] and [Unsafe] cannot be used together.
-The sieve in the normal version is pretty optimized and only sieves as high as it needs to go,
-    which could be much less than sqrt(n) if n has several factors.
-Using wheel factorization is faster than sieving if you're only factoring a couple numbers.
-The sieved version becomes much faster after the first sieve (which you should do manually, and use [Unsafe]), and catches up quickly.
+The normal version doesn't need a big sieve. It divides out the primes below 1000,
+    then splits whatever is left with Pollard's rho (Brent's version, with SQUFOF as a backup if that ever gets stuck),
+    checking each piece with the same test as isPrime. The worst case is two 32-bit primes multiplied together,
+    since rho takes about 2^16 steps to find either of them. Measured with -O2 on one core of an Intel Xeon virtual machine,
+    a random 64-bit number takes about 25 microseconds, and 300 random products of two 32-bit primes took
+    about 650 microseconds each in the middle, 2 milliseconds at the 99th percentile, and up to 4 milliseconds.
+[Wheel] and [Unsafe] still use trial division up to sqrt(n), so they're only faster when n has no large prime factors,
+    or is small enough that sqrt(n) is only a few thousand.
 
 Example:
     unsigned long long x[15];
@@ -93,20 +186,82 @@ Example:
 
 
 
+To factor every number in a range, use factorRange(lo,hi,f) instead of calling factor on each one.
+It sieves [lo, hi] a segment at a time, dividing every multiple of each prime up to sqrt(hi) as it goes,
+    so it only needs the sieve up to sqrt(hi), and the range can be far above 4289995710.
+    Every segment of 32768 numbers goes through all the primes up to sqrt(hi), though, so the higher the range is, the slower it gets.
+    On my computer, factoring the 10 million numbers after 1 trillion takes 0.7 seconds.
+For every n from lo to hi, in order, it calls f(n,x,y,m), where x, y, and m are what factor(n,x,y) would give you.
+To just get the smallest prime factor of every number, use smallestFactors(lo,hi,spf),
+    where spf is an array of unsigned long long with room for hi-lo+1 numbers.
+
+Example:
+    PrimeData pd;
+    pd.factorRange(1000000000000,1000000000100,[](unsigned long long n, const unsigned long long* x, const unsigned char* y, unsigned char m){
+        std::cout<<n<<" =";
+        for(unsigned char i=0; i<m; ++i)
+            std::cout<<' '<<x[i]<<'^'<<(int)y[i];
+        std::cout<<std::endl;
+    });
+
 To find how many primes exist up to n, use numPrimesUpTo(n).
 The optimization numPrimesUpToSmall(n) is included, where [Small] works the same way as above.
+If you're going to count primes many times with a sieve you've already built, call buildRankIndex() too.
+    It keeps a running count of the primes before every 64-byte line of the sieve, which costs another 25% of the sieve's memory,
+    and from then on, numPrimesUpTo(n) is one lookup and one popcount whenever n is within the sieve.
+    It's kept up to date if the sieve grows afterwards.
+These don't sieve up to n. They only build the sieve up to sqrt(n), use whatever has already been built,
+    and count the rest one segment at a time, throwing each segment away after it's counted.
+    This keeps the memory down to the primes up to sqrt(n) plus one segment, so they go well past 15.5 billion.
+    If you want to query the primes afterwards, call buildSieveTo(n) yourself first.
+Once n is past 10 million and far enough past the sieve, numPrimesUpTo(n) doesn't sieve the rest at all.
+    It uses the Lagarias-Miller-Odlyzko method instead, which only has to sieve up to about n^(2/3),
+    and needs about n^(1/3) memory on top of the sieve up to sqrt(n). To always use it, call numPrimesUpToLMO(n).
+    It runs on one thread. On my computer, with the -O2 flag:
+
+                            1 billion       10 billion      100 billion     1 trillion      10^13       10^14       10^15       10^16
+    counting the segments:  0.61 seconds    7.1 seconds
+    numPrimesUpToLMO:       0.002 seconds   0.005 seconds   0.019 seconds   0.083 seconds   0.39 sec    1.5 sec     8.0 sec     37.9 sec
+
+
+
+If you just need to go through the primes in order, use forEachPrime(lo,hi,f), which calls f(p) for every prime p from lo to hi.
+It doesn't store them anywhere. Whatever part of the range is already in the sieve is read straight out of it,
+    and the rest is sieved one segment at a time and thrown away, so it only needs the sieve up to sqrt(hi) and one segment.
+If the range is narrow next to sqrt(hi), it tests each number with the same test as isPrime instead.
+On my computer, it goes through the 455 million primes below 10 billion in about 9 seconds.
+
+Example:
+    PrimeData pd;
+    unsigned long long sum=0;
+    pd.forEachPrime(0,1000000000000,[&](unsigned long long p){
+        sum+=p;
+    });
 
+To work with the primes in some range [lo,hi] without sieving everything below it, use sieveRange(lo,hi).
+It sieves just that range, with the primes up to sqrt(hi), so it takes time in proportion to hi-lo plus sqrt(hi), and not hi.
+    Once hi is past 10^12, most of those primes hit less than once per segment, so they wait in buckets for the segment their next multiple is in,
+    instead of being checked every segment. On my computer, the 7 million primes in 300 million numbers past 10^18 take 3.5 seconds.
+It returns a PrimeWindow, which keeps the range in the same format as the sieve, 720 bytes per 30030 numbers, and has
+    isPrime(n), numPrimesUpTo(n) (counting from lo), numPrimes(), nextPrime(n), and forEachPrime(f), for any n from lo to hi.
+    nextPrime returns 0 if there isn't another prime in the window.
+primesInRange(lo,hi,primes) puts the primes from lo to hi in a vector instead.
 
+Example:
+    PrimeData pd;
+    PrimeWindow window=pd.sieveRange(1000000000000000,1000000001000000);
+    std::cout<<window.numPrimes()<<' '<<window.nextPrime(1000000000000000)<<std::endl;
 
 To generate the actual primes up to n, use primesUpTo(n,primes), where primes is a vector of unsigned long long.
-If you are only calling this once, you don't need to call buildSieveTo(n) first, it will handle it.
-This function takes longer than buildSieveTo(n), but it stores the primes in a human-readable format,
-    rather than just being queryable with isPrime(n) and factor(n).
-Its return value is an unsigned long long that represents the number of primes in the vector.
-    Calling primes.size() will return 0 and is not helpful.
+You don't need to call buildSieveTo(n) first. It goes through forEachPrime, so it only builds the sieve up to sqrt(n).
+Its return value is an unsigned long long that represents the number of primes in the vector, which is also primes.size().
 The optimization primesUpToSmall(n,primes) is included, where [Small] works the same way as above.
     In this case, n, primes, and the return value are all unsigned ints instead of unsigned long long.
-On my computer, calling primesUpTo(n) errors out at 4.6 billion  --  "what():  std::bad_alloc"
+The vector takes 8 bytes per prime (4 with [Small]), and that's what runs out of memory first.
+To go further, pass a PrimeList instead of a vector. It keeps the gaps between the primes, 1 byte each, plus every 128th prime whole,
+    so it takes about 1.13 bytes per prime, and all 4.1 billion primes below 100 billion fit in under 5GB.
+    primes[i] decodes at most 127 gaps from the nearest whole prime, and going through it in order with begin() and end() just adds up the gaps.
+    firstPrimes(n,primes) takes a PrimeList too.
 
 Example:
     std::vector<unsigned int> primes;
@@ -118,12 +273,11 @@ Example:
 
 
 To generate the first n primes, use firstPrimes(n,primes), where primes is a vector of unsigned long long.
-If you are only calling this once, you don't need to call buildSieveTo(n) first.
+You don't need to call buildSieveTo(n) first.
 The optimization firstPrimesSmall(n,primes) is included. In this case,
     n must be at most 203056267, the number of primes below 4289995710, and
     primes must be a vector of unsigned int instead of unsigned long long.
 This function can go a bit further than primesUpTo, because it knows ahead of time how large to make the vector, and doesn't have to overcompensate.
-    On my computer, I can safely generate the first 230 million primes, up to around 4.9 billion.
 
 Example:
     std::vector<unsigned long long> primes;
@@ -131,6 +285,12 @@ Example:
     pd.firstPrimes(100000000,primes);
     std::cout<<primes[99999999]<<endl;
 
+If you only want the nth prime, use nthPrime(n) instead, which returns it (nthPrime(1) is 2).
+It guesses the nth prime with the inverse of li(x), counts the primes up to the guess with numPrimesUpTo,
+    and then only sieves the few windows between the guess and the answer, so it never needs a sieve past about sqrt of the answer.
+On my computer, nthPrime(100000000) takes 4ms where firstPrimes(100000000,primes) takes 2.5s,
+    and nthPrime(100000000000) takes 0.25s.
+
 
 
 The length of time taken by these functions, in order, is roughly:
@@ -147,685 +307,2781 @@ Above that range, I can only test numPrimesUpTo, and the ratio is smaller while
 
 
 #include <vector>
+#include <algorithm>
+#include <iterator>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <string>
+#include <cstddef>
+#include <cstdio>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef ZMATH_STATS
+#include <chrono>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-class PrimeData {
+// The sieve is stored as a plain array of 64-bit words, one bit per number that isn't divisible by 2, 3, 5, 7, 11, or 13.
+// A wheel period of 30030 has 5760 of those, which is exactly 90 words (720 bytes), so every period starts on a word.
+// Scanning for the next prime skips a whole word of composites at a time, and counting is a popcount per word.
+// The words are aligned to cache lines, and the size is only limited by memory. On Linux, growing it doesn't copy the words it already has.
+class WheelBitset {
     public:
-        PrimeData(){
-            sieve.push_back(0);
-            const unsigned short tempconversions[480] = {1,13,17,19,23,29,31,37,41,43,47,53,59,61,67,71,73,79,83,89,97,101,103,107,109,113,127,131,137,139,149,151,157,163,167,169,173,179,181,191,193,197,199,211,221,223,227,229,233,239,241,247,251,257,263,269,271,277,281,283,289,293,299,307,311,313,317,323,331,337,347,349,353,359,361,367,373,377,379,383,389,391,397,401,403,409,419,421,431,433,437,439,443,449,457,461,463,467,479,481,487,491,493,499,503,509,521,523,527,529,533,541,547,551,557,559,563,569,571,577,587,589,593,599,601,607,611,613,617,619,629,631,641,643,647,653,659,661,667,673,677,683,689,691,697,701,703,709,713,719,727,731,733,739,743,751,757,761,767,769,773,779,787,793,797,799,809,811,817,821,823,827,829,839,841,851,853,857,859,863,871,877,881,883,887,893,899,901,907,911,919,923,929,937,941,943,947,949,953,961,967,971,977,983,989,991,997,1003,1007,1009,1013,1019,1021,1027,1031,1033,1037,1039,1049,1051,1061,1063,1069,1073,1079,1081,1087,1091,1093,1097,1103,1109,1117,1121,1123,1129,1139,1147,1151,1153,1157,1159,1163,1171,1181,1187,1189,1193,1201,1207,1213,1217,1219,1223,1229,1231,1237,1241,1247,1249,1259,1261,1271,1273,1277,1279,1283,1289,1291,1297,1301,1303,1307,1313,1319,1321,1327,1333,1339,1343,1349,1357,1361,1363,1367,1369,1373,1381,1387,1391,1399,1403,1409,1411,1417,1423,1427,1429,1433,1439,1447,1451,1453,1457,1459,1469,1471,1481,1483,1487,1489,1493,1499,1501,1511,1513,1517,1523,1531,1537,1541,1543,1549,1553,1559,1567,1571,1577,1579,1583,1591,1597,1601,1607,1609,1613,1619,1621,1627,1633,1637,1643,1649,1651,1657,1663,1667,1669,1679,1681,1691,1693,1697,1699,1703,1709,1711,1717,1721,1723,1733,1739,1741,1747,1751,1753,1759,1763,1769,1777,1781,1783,1787,1789,1801,1807,1811,1817,1819,1823,1829,1831,1843,1847,1849,1853,1861,1867,1871,1873,1877,1879,1889,1891,1901,1907,1909,1913,1919,1921,1927,1931,1933,1937,1943,1949,1951,1957,1961,1963,1973,1979,1987,1993,1997,1999,2003,2011,2017,2021,2027,2029,2033,2039,2041,2047,2053,2059,2063,2069,2071,2077,2081,2083,2087,2089,2099,2111,2113,2117,2119,2129,2131,2137,2141,2143,2147,2153,2159,2161,2171,2173,2179,2183,2197,2201,2203,2207,2209,2213,2221,2227,2231,2237,2239,2243,2249,2251,2257,2263,2267,2269,2273,2279,2281,2287,2291,2293,2297,2309};
-            unsigned char j=0;
-            unsigned short k=0;
-            for(unsigned short i=0; i<5760; ++i){
-                unsigned short n=2310*j+tempconversions[k];
-                while(!(n%13)){
-                    ++k;
-                    if(k==480){
-                        ++j;
-                        k=0;
-                    }
-                    n=2310*j+tempconversions[k];
+        WheelBitset(){}
+        WheelBitset(const WheelBitset& other){
+            *this=other;
+        }
+        // A copy goes straight into a mapping of its own, since it's usually a whole sieve that's about to be grown
+        WheelBitset& operator=(const WheelBitset& other){
+            if(this!=&other){
+                release();
+                numwords=0;
+                capacity=0;
+                if(other.numwords){
+                    grow(other.numwords);
+                    memcpy(words,other.words,other.numwords*8);
+                    numwords=other.numwords;
+                }
+            }
+            return *this;
+        }
+        WheelBitset(WheelBitset&& other){
+            *this=std::move(other);
+        }
+        WheelBitset& operator=(WheelBitset&& other){
+            if(this!=&other){
+                release();
+                raw=other.raw;
+                mapping=other.mapping;
+                mappingsize=other.mappingsize;
+                anonymous=other.anonymous;
+                words=other.words;
+                numwords=other.numwords;
+                capacity=other.capacity;
+                other.raw=0;
+                other.mapping=0;
+                other.words=0;
+                other.numwords=0;
+                other.capacity=0;
+            }
+            return *this;
+        }
+        ~WheelBitset(){
+            release();
+        }
+
+        bool operator[](unsigned long long b) const {
+            return words[b>>6]>>(b&63)&1;
+        }
+        void reset(unsigned long long b){
+            words[b>>6]&=~(1ULL<<(b&63));
+        }
+        void set(unsigned long long b){
+            words[b>>6]|=1ULL<<(b&63);
+        }
+        // Copies n words from src over the ones starting at word i
+        void copyWords(unsigned long long i, const unsigned long long* src, unsigned long long n){
+            memcpy(words+i,src,n*8);
+        }
+        // Clears the bits in the n words starting at word i that are clear in src
+        void andWords(unsigned long long i, const unsigned long long* src, unsigned long long n){
+            unsigned long long* w=words+i;
+            for(unsigned long long k=0; k<n; ++k)
+                w[k]&=src[k];
+        }
+        unsigned long long size() const {
+            return numwords*64;
+        }
+        const unsigned long long* data() const {
+            return words;
+        }
+        // The memory set aside for the words, including room to grow into
+        unsigned long long bytes() const {
+            return capacity*8;
+        }
+
+        // Grows to hold at least n bits, setting the new ones. It never shrinks.
+        // The words live in an anonymous mapping with room to spare, and when that runs out, it is at least doubled with mremap,
+        // which on Linux moves the pages over instead of copying them, so the bits that are already there are never copied.
+        void resize(unsigned long long n){
+            unsigned long long nw=(n+63)/64;
+            if(nw<=numwords)
+                return;
+            if(nw>capacity)
+                grow(std::max(nw,capacity*2));
+            memset(words+numwords,0xff,(nw-numwords)*8);
+            numwords=nw;
+        }
+        // Uses nw words at offset bytes into the file fd, mapped copy-on-write, so pages that are only read
+        // stay shared with every other process that has the same file mapped. The file must be at least offset+nw*8 bytes,
+        // and offset must be a multiple of the page size. Growing it afterwards copies it into memory of its own.
+        bool map(int fd, unsigned long long offset, unsigned long long nw){
+            void* m=mmap(0,offset+nw*8,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+            if(m==MAP_FAILED)
+                return false;
+            release();
+            mapping=m;
+            mappingsize=offset+nw*8;
+            anonymous=false;
+            words=(unsigned long long*)((char*)m+offset);
+            numwords=nw;
+            capacity=nw;
+            return true;
+        }
+        // Resizes to exactly n bits, rounded up to a word, and sets all of them.
+        void assign(unsigned long long n){
+            unsigned long long nw=(n+63)/64;
+            if(nw>capacity)
+                allocate(nw);
+            numwords=nw;
+            memset(words,0xff,nw*8);
+        }
+
+        // Returns the first set bit at or after b. There must be one before the end.
+        unsigned long long next(unsigned long long b) const {
+            unsigned long long i=b>>6;
+            unsigned long long w=words[i]&(~0ULL<<(b&63));
+            while(!w)
+                w=words[++i];
+            return i*64+__builtin_ctzll(w);
+        }
+        // Returns the last set bit at or before b. There must be one.
+        unsigned long long prev(unsigned long long b) const {
+            unsigned long long i=b>>6;
+            unsigned long long w=words[i]&(~0ULL>>(63-(b&63)));
+            while(!w)
+                w=words[--i];
+            return i*64+63-__builtin_clzll(w);
+        }
+        // Returns the number of set bits in [lo, hi).
+        unsigned long long count(unsigned long long lo, unsigned long long hi) const {
+            if(lo>=hi)
+                return 0;
+            unsigned long long i=lo>>6;
+            unsigned long long last=hi>>6;
+            unsigned long long w=words[i]&(~0ULL<<(lo&63));
+            if(i==last)
+                return __builtin_popcountll(w&((1ULL<<(hi&63))-1));
+            unsigned long long t=__builtin_popcountll(w);
+            for(++i; i<last; ++i)
+                t+=__builtin_popcountll(words[i]);
+            if(hi&63)
+                t+=__builtin_popcountll(words[last]&((1ULL<<(hi&63))-1));
+            return t;
+        }
+
+    private:
+        char* raw = 0;
+        void* mapping = 0;
+        unsigned long long mappingsize = 0;
+        bool anonymous = false;
+        unsigned long long* words = 0;
+        unsigned long long numwords = 0;
+        unsigned long long capacity = 0;
+
+        void release(){
+            free(raw);
+            raw=0;
+            if(mapping)
+                munmap(mapping,mappingsize);
+            mapping=0;
+        }
+        void allocate(unsigned long long nw){
+            release();
+            raw=(char*)malloc(nw*8+64);
+            if(!raw)
+                throw std::bad_alloc();
+            words=(unsigned long long*)(raw+(64-(unsigned long long)raw%64)%64);
+            numwords=nw;
+            capacity=nw;
+        }
+        // Moves the words into an anonymous mapping with room for nw of them. Pages past the ones in use aren't touched,
+        // so they don't take up any memory until the bitset grows into them.
+        void grow(unsigned long long nw){
+            unsigned long long page=sysconf(_SC_PAGESIZE);
+            unsigned long long size=(nw*8+page-1)/page*page;
+            void* m;
+#ifdef __linux__
+            if(mapping && anonymous)
+                m=mremap(mapping,mappingsize,size,MREMAP_MAYMOVE);
+            else
+#endif
+            {
+                // Memory from malloc, or a snapshot file, has to be copied once (and everywhere but Linux, every time)
+#ifdef MAP_NORESERVE
+                m=mmap(0,size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+#else
+                m=mmap(0,size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+#endif
+                if(m!=MAP_FAILED){
+                    if(numwords)
+                        memcpy(m,words,numwords*8);
+                    release();
                 }
-                conversions[i]=n;
-                indexes[n]=i;
+            }
+            if(m==MAP_FAILED)
+                throw std::bad_alloc();
+            mapping=m;
+            mappingsize=size;
+            anonymous=true;
+            words=(unsigned long long*)m;
+            capacity=size/8;
+        }
+};
+
+// The wheel tables are the same for every PrimeData, so the compiler works them out once, into read-only memory that they all share.
+// conversions[i] is the ith number below 30030 that isn't divisible by 2, 3, 5, 7, 11, or 13, wheel[i] is the gap to the next one,
+// and indexes[n] is the position of n in conversions, or of the next one after n if n isn't in it.
+struct WheelTables {
+    unsigned short conversions[5760];
+    unsigned char wheel[5760];
+    unsigned short indexes[30030];
+
+    constexpr WheelTables() : conversions(), wheel(), indexes() {
+        const unsigned short tempconversions[480] = {1,13,17,19,23,29,31,37,41,43,47,53,59,61,67,71,73,79,83,89,97,101,103,107,109,113,127,131,137,139,149,151,157,163,167,169,173,179,181,191,193,197,199,211,221,223,227,229,233,239,241,247,251,257,263,269,271,277,281,283,289,293,299,307,311,313,317,323,331,337,347,349,353,359,361,367,373,377,379,383,389,391,397,401,403,409,419,421,431,433,437,439,443,449,457,461,463,467,479,481,487,491,493,499,503,509,521,523,527,529,533,541,547,551,557,559,563,569,571,577,587,589,593,599,601,607,611,613,617,619,629,631,641,643,647,653,659,661,667,673,677,683,689,691,697,701,703,709,713,719,727,731,733,739,743,751,757,761,767,769,773,779,787,793,797,799,809,811,817,821,823,827,829,839,841,851,853,857,859,863,871,877,881,883,887,893,899,901,907,911,919,923,929,937,941,943,947,949,953,961,967,971,977,983,989,991,997,1003,1007,1009,1013,1019,1021,1027,1031,1033,1037,1039,1049,1051,1061,1063,1069,1073,1079,1081,1087,1091,1093,1097,1103,1109,1117,1121,1123,1129,1139,1147,1151,1153,1157,1159,1163,1171,1181,1187,1189,1193,1201,1207,1213,1217,1219,1223,1229,1231,1237,1241,1247,1249,1259,1261,1271,1273,1277,1279,1283,1289,1291,1297,1301,1303,1307,1313,1319,1321,1327,1333,1339,1343,1349,1357,1361,1363,1367,1369,1373,1381,1387,1391,1399,1403,1409,1411,1417,1423,1427,1429,1433,1439,1447,1451,1453,1457,1459,1469,1471,1481,1483,1487,1489,1493,1499,1501,1511,1513,1517,1523,1531,1537,1541,1543,1549,1553,1559,1567,1571,1577,1579,1583,1591,1597,1601,1607,1609,1613,1619,1621,1627,1633,1637,1643,1649,1651,1657,1663,1667,1669,1679,1681,1691,1693,1697,1699,1703,1709,1711,1717,1721,1723,1733,1739,1741,1747,1751,1753,1759,1763,1769,1777,1781,1783,1787,1789,1801,1807,1811,1817,1819,1823,1829,1831,1843,1847,1849,1853,1861,1867,1871,1873,1877,1879,1889,1891,1901,1907,1909,1913,1919,1921,1927,1931,1933,1937,1943,1949,1951,1957,1961,1963,1973,1979,1987,1993,1997,1999,2003,2011,2017,2021,2027,2029,2033,2039,2041,2047,2053,2059,2063,2069,2071,2077,2081,2083,2087,2089,2099,2111,2113,2117,2119,2129,2131,2137,2141,2143,2147,2153,2159,2161,2171,2173,2179,2183,2197,2201,2203,2207,2209,2213,2221,2227,2231,2237,2239,2243,2249,2251,2257,2263,2267,2269,2273,2279,2281,2287,2291,2293,2297,2309};
+        unsigned char j=0;
+        unsigned short k=0;
+        for(unsigned short i=0; i<5760; ++i){
+            unsigned short n=2310*j+tempconversions[k];
+            while(!(n%13)){
                 ++k;
                 if(k==480){
                     ++j;
                     k=0;
                 }
+                n=2310*j+tempconversions[k];
             }
-            for(unsigned short i=0; i<5759; ++i)
-                wheel[i]=conversions[i+1]-conversions[i];
-            wheel[5759]=2;
+            conversions[i]=n;
+            indexes[n]=i;
+            ++k;
+            if(k==480){
+                ++j;
+                k=0;
+            }
+        }
+        for(unsigned short i=0; i<5759; ++i)
+            wheel[i]=conversions[i+1]-conversions[i];
+        wheel[5759]=2;
+        // Residues that share a factor with 30030 point at the next residue that doesn't,
+        // so indexes[n%30030] is also the number of wheel residues below n%30030.
+        unsigned short next=5760;
+        for(unsigned short i=30029; i<30030; --i){
+            if(conversions[indexes[i]]==i)
+                next=indexes[i];
+            else
+                indexes[i]=next;
         }
+    }
+};
+// Trial division by the wheel numbers below 2^16 multiplies instead of dividing. If p is the bth wheel number,
+// multiplying by inverse[b], the inverse of p mod 2^64, maps the multiples of p onto 0 through limit[b] = (2^64-1)/p,
+// and everything else above that, and for a multiple of p it gives exactly n/p.
+// The low half of inverse[b] and the high half of limit[b] do the same thing mod 2^32, and those get arrays of their own,
+// so they can be loaded 8 or 16 at a time.
+struct TrialDivisors {
+    // (there's no definition outside the class, so anything that takes it by reference, like std::min, has to get +count)
+    static const unsigned int count = 12569;
+    unsigned long long inverse[count];
+    unsigned long long limit[count];
+    alignas(64) unsigned int inverse32[count];
+    alignas(64) unsigned int limit32[count];
 
-        void buildSieveTo(unsigned long long n){
-            if(n<=4289995710U)
-                doSieve(n);
-            else{
-                doSieve(4289995710U);
-                doBigSieve(n);
+    constexpr TrialDivisors(const WheelTables& tables) : inverse(), limit(), inverse32(), limit32() {
+        for(unsigned int b=0; b<count; ++b){
+            unsigned long long p=b/5760*30030+tables.conversions[b%5760];
+            // p*p is 1 mod 8, so p starts out right to 3 bits, and each step doubles that
+            unsigned long long x=p;
+            for(int i=0; i<5; ++i)
+                x*=2-p*x;
+            inverse[b]=x;
+            limit[b]=~0ULL/p;
+            inverse32[b]=x;
+            limit32[b]=limit[b]>>32;
+        }
+    }
+};
+
+// A static member of a class template can be defined in a header, so this stays one copy however many files include it.
+template<class Unused=void> struct SharedWheelTables {
+    static constexpr WheelTables tables{};
+    static constexpr TrialDivisors divisors{tables};
+};
+template<class Unused> constexpr WheelTables SharedWheelTables<Unused>::tables;
+template<class Unused> constexpr TrialDivisors SharedWheelTables<Unused>::divisors;
+
+// The primes from 17 to 61 cross off the most bits, one at a time, so they're done ahead of time instead.
+// words[k] is primes[k] wheel periods of the sieve, 90 words each, with just the multiples of primes[k] crossed off.
+// That repeats every primes[k] periods, so a segment starts out as a copy of the first pattern ANDed with the rest.
+// They're worked out the first time they're needed, since they'd take the compiler too long, and come to 331KB.
+struct PresievePatterns {
+    static const unsigned int count = 12;
+    unsigned int primes[count];
+    std::vector<unsigned long long> words[count];
+
+    PresievePatterns() : primes{17,19,23,29,31,37,41,43,47,53,59,61} {
+        const WheelTables& tables=SharedWheelTables<>::tables;
+        for(unsigned int k=0; k<count; ++k){
+            unsigned int p=primes[k];
+            words[k].assign(p*90,~0ULL);
+            // numbers below 30030*p, at p times each wheel number below 30030
+            for(unsigned int b=0; b<5760; ++b){
+                unsigned int n=p*tables.conversions[b];
+                unsigned int i=n/30030*5760+tables.indexes[n%30030];
+                words[k][i>>6]&=~(1ULL<<(i&63));
             }
         }
+    }
+};
 
-        bool isPrime(unsigned long long n){
-            if(n==2 || n==3 || n==5 || n==7 || n==11 || n==13)
-                return true;
-            if(!(n&1U) || !(n%3) || !(n%5) || !(n%7) || !(n%11) || !(n%13))
-                return false;
-            buildSieveTo(n);
-            if(n<=4289995710U)
-                return sieve[n/30030*5760+indexes[n%30030]];
-            return bigsieve[n/30030*5760+indexes[n%30030]-822856320];
+// A range [lo, hi] of numbers that was sieved on its own, by PrimeData::sieveRange.
+// The bits are in the same format as the main sieve, starting from the wheel period that lo is in.
+class PrimeWindow {
+    friend class PrimeData;
+    public:
+        unsigned long long lo() const {
+            return from;
         }
-        bool isPrimeUnsafe(unsigned long long n){
-            if(n==2 || n==3 || n==5 || n==7 || n==11 || n==13)
-                return true;
-            if(!(n&1U) || !(n%3) || !(n%5) || !(n%7) || !(n%11) || !(n%13))
-                return false;
-            if(n<=4289995710U)
-                return sieve[n/30030*5760+indexes[n%30030]];
-            return bigsieve[n/30030*5760+indexes[n%30030]-822856320];
+        unsigned long long hi() const {
+            return to;
         }
-        bool isPrimeSmall(unsigned int n){
+        // n must be from lo to hi
+        bool isPrime(unsigned long long n) const {
             if(n==2 || n==3 || n==5 || n==7 || n==11 || n==13)
                 return true;
-            if(!(n&1U) || !(n%3) || !(n%5) || !(n%7) || !(n%11) || !(n%13))
+            unsigned int r=n%30030;
+            unsigned int b=tables().indexes[r];
+            if(b==5760 || tables().conversions[b]!=r)
                 return false;
-            doSieve(n);
-            return sieve[n/30030*5760+indexes[n%30030]];
+            return bits[n/30030*5760+b-offset];
         }
-        bool isPrimeSmallUnsafe(unsigned int n){
-            if(n==2 || n==3 || n==5 || n==7 || n==11 || n==13)
-                return true;
-            if(!(n&1U) || !(n%3) || !(n%5) || !(n%7) || !(n%11) || !(n%13))
-                return false;
-            return sieve[n/30030*5760+indexes[n%30030]];
+        // The number of primes from lo to n
+        unsigned long long numPrimesUpTo(unsigned long long n) const {
+            n=std::min(n,to);
+            if(n<from)
+                return 0;
+            unsigned long long t=0;
+            const unsigned int firstsix[6]={2,3,5,7,11,13};
+            for(unsigned int k=0; k<6; ++k)
+                t+=firstsix[k]>=from && firstsix[k]<=n;
+            return t+bits.count(bit(std::max(from,17ULL)),bit(n+1));
         }
-        bool isPrimeWheel(unsigned long long n){
-            if(n==2 || n==3 || n==5 || n==7 || n==11 || n==13)
-                return true;
-            if(n==1 || !(n&1U) || !(n%3) || !(n%5) || !(n%7) || !(n%11) || !(n%13))
-                return false;
-            unsigned int p=17;
-            unsigned short w=1;
-            unsigned int sqrtn=sqrt(n);
-            while(p<=sqrtn){
-                if(!(n%p))
-                    return false;
-                p+=wheel[w];
-                ++w;
-                w%=5760;
-            }
-            return true;
+        unsigned long long numPrimes() const {
+            return numPrimesUpTo(to);
         }
-        bool isPrimeSmallWheel(unsigned int n){
-            if(n==2 || n==3 || n==5 || n==7 || n==11 || n==13)
-                return true;
-            if(n==1 || !(n&1U) || !(n%3) || !(n%5) || !(n%7) || !(n%11) || !(n%13))
-                return false;
-            unsigned int p=17;
-            unsigned short w=1;
-            unsigned int sqrtn=sqrt(n);
-            while(p<=sqrtn){
-                if(!(n%p))
-                    return false;
-                p+=wheel[w];
-                ++w;
-                w%=5760;
+        // The first prime from n to hi, or 0 if there isn't one
+        unsigned long long nextPrime(unsigned long long n) const {
+            n=std::max(n,from);
+            const unsigned int firstsix[6]={2,3,5,7,11,13};
+            for(unsigned int k=0; k<6; ++k){
+                if(firstsix[k]>=n)
+                    return firstsix[k]<=to ? firstsix[k] : 0;
+            }
+            if(n>to)
+                return 0;
+            const unsigned long long* words=bits.data();
+            unsigned long long end=bit(to+1);
+            for(unsigned long long b=bit(n); b<end; b=(b|63)+1){
+                unsigned long long w=words[b>>6]&(~0ULL<<(b&63));
+                if(w){
+                    b=(b&~63ULL)+__builtin_ctzll(w);
+                    return b<end ? number(b) : 0;
+                }
             }
-            return true;
+            return 0;
         }
-
-        unsigned char factor(unsigned long long n, unsigned long long* factors, unsigned char* exponents){
-            unsigned char exp=0;
-            unsigned char numfacs=0;
-            while(!(n&1U)){
-                ++exp;
-                n>>=1;
-            }
-            if(exp){
-                factors[0]=2;
-                exponents[0]=exp;
-                numfacs=1;
-                exp=0;
-            }
-            while(!(n%3)){
-                ++exp;
-                n/=3;
-            }
-            if(exp){
-                factors[numfacs]=3;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
-            }
-            while(!(n%5)){
-                ++exp;
-                n/=5;
-            }
-            if(exp){
-                factors[numfacs]=5;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
-            }
-            while(!(n%7)){
-                ++exp;
-                n/=7;
-            }
-            if(exp){
-                factors[numfacs]=7;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
-            }
-            while(!(n%11)){
-                ++exp;
-                n/=11;
+        // The jth prime from lo, counting from 1, or 0 if the window has fewer than j primes
+        unsigned long long nthPrime(unsigned long long j) const {
+            if(!j)
+                return 0;
+            const unsigned int firstsix[6]={2,3,5,7,11,13};
+            for(unsigned int k=0; k<6; ++k){
+                if(firstsix[k]>=from && firstsix[k]<=to && !--j)
+                    return firstsix[k];
             }
-            if(exp){
-                factors[numfacs]=11;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
+            if(to<17)
+                return 0;
+            const unsigned long long* words=bits.data();
+            unsigned long long first=bit(std::max(from,17ULL));
+            unsigned long long last=bit(to+1);
+            for(unsigned long long i=first>>6; first<last && i<=(last-1)>>6; ++i){
+                unsigned long long w=words[i];
+                if(i==first>>6)
+                    w&=~0ULL<<(first&63);
+                if(i==(last-1)>>6 && (last&63))
+                    w&=(1ULL<<(last&63))-1;
+                // whole words are skipped by their popcount
+                unsigned int c=__builtin_popcountll(w);
+                if(j>c){
+                    j-=c;
+                    continue;
+                }
+                while(--j)
+                    w&=w-1;
+                return number(i*64+__builtin_ctzll(w));
             }
-            while(!(n%13)){
-                ++exp;
-                n/=13;
+            return 0;
+        }
+        // Calls f(p) for every prime p from lo to hi, in order
+        template<class F> void forEachPrime(F f) const {
+            const unsigned int firstsix[6]={2,3,5,7,11,13};
+            for(unsigned int k=0; k<6; ++k){
+                if(firstsix[k]>=from && firstsix[k]<=to)
+                    f((unsigned long long)firstsix[k]);
+            }
+            if(to<17)
+                return;
+            const unsigned long long* words=bits.data();
+            unsigned long long first=bit(std::max(from,17ULL));
+            unsigned long long last=bit(to+1);
+            for(unsigned long long i=first>>6; first<last && i<=(last-1)>>6; ++i){
+                unsigned long long w=words[i];
+                if(i==first>>6)
+                    w&=~0ULL<<(first&63);
+                if(i==(last-1)>>6 && (last&63))
+                    w&=(1ULL<<(last&63))-1;
+                while(w){
+                    f(number(i*64+__builtin_ctzll(w)));
+                    w&=w-1;
+                }
             }
-            if(exp){
-                factors[numfacs]=13;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
-            }
-            unsigned int b = 1;
-            unsigned long long p = 17;
-            if((unsigned long long)maxsieve*maxsieve<n){
-                while(b<maxbool && p*p<=n){
-                    while(!(n%p)){
-                        ++exp;
-                        n/=p;
-                    }
-                    if(exp){
-                        factors[numfacs]=p;
-                        exponents[numfacs]=exp;
-                        ++numfacs;
-                        exp=0;
-                    }
-                    ++b;
-                    while(!sieve[b])
-                        ++b;
-                    p = b/5760*30030+conversions[b%5760];
+        }
+
+    private:
+        WheelBitset bits;
+        unsigned long long from = 1;
+        unsigned long long to = 0;
+        // The bit number of the start of the first wheel period, in the main sieve
+        unsigned long long offset = 0;
+
+        static const WheelTables& tables(){
+            return SharedWheelTables<>::tables;
+        }
+        // The bit for n, or for the first number after it that isn't divisible by 2, 3, 5, 7, 11, or 13
+        unsigned long long bit(unsigned long long n) const {
+            return n/30030*5760+tables().indexes[n%30030]-offset;
+        }
+        unsigned long long number(unsigned long long b) const {
+            return (b+offset)/5760*30030+tables().conversions[(b+offset)%5760];
+        }
+};
+
+// An increasing list of primes, kept as the gaps between them, one byte each.
+// Every 128th prime is also kept whole, along with where the gaps after it start, so operator[] decodes at most 127 gaps.
+class PrimeList {
+    public:
+        class const_iterator {
+            friend class PrimeList;
+            public:
+                typedef std::forward_iterator_tag iterator_category;
+                typedef unsigned long long value_type;
+                typedef std::ptrdiff_t difference_type;
+                typedef const unsigned long long* pointer;
+                typedef unsigned long long reference;
+
+                unsigned long long operator*() const {
+                    return p;
                 }
-                if(p*p<=n)
-                    buildSieveTo(sqrt(n));
-            }
-            if(p*p<=n){
-                while(!sieve[b])
-                    ++b;
-                p = b/5760*30030+conversions[b%5760];
-            }
-            while(p*p<=n){
-                while(!(n%p)){
-                    ++exp;
-                    n/=p;
+                const_iterator& operator++(){
+                    if(++i<n)
+                        p+=gap(g);
+                    return *this;
                 }
-                if(exp){
-                    factors[numfacs]=p;
-                    exponents[numfacs]=exp;
-                    ++numfacs;
-                    exp=0;
+                const_iterator operator++(int){
+                    const_iterator old=*this;
+                    ++*this;
+                    return old;
                 }
-                ++b;
-                while(!sieve[b])
-                    ++b;
-                p = b/5760*30030+conversions[b%5760];
-            }
-            if(n>1){
-                factors[numfacs]=n;
-                exponents[numfacs]=1;
-                factors[numfacs+1]=0;
-                ++numfacs;
-            }
-            return numfacs;
+                bool operator==(const const_iterator& o) const {
+                    return i==o.i;
+                }
+                bool operator!=(const const_iterator& o) const {
+                    return i!=o.i;
+                }
+
+            private:
+                const unsigned char* g;
+                unsigned long long p;
+                size_t i;
+                size_t n;
+        };
+
+        size_t size() const {
+            return n;
         }
-        unsigned char factorUnsafe(unsigned long long n, unsigned long long* factors, unsigned char* exponents){
-            unsigned char exp=0;
-            unsigned char numfacs=0;
-            while(!(n&1U)){
-                ++exp;
-                n>>=1;
-            }
-            if(exp){
-                factors[0]=2;
-                exponents[0]=exp;
-                numfacs=1;
-                exp=0;
-            }
-            while(!(n%3)){
-                ++exp;
-                n/=3;
-            }
-            if(exp){
-                factors[numfacs]=3;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
-            }
-            while(!(n%5)){
-                ++exp;
-                n/=5;
-            }
-            if(exp){
-                factors[numfacs]=5;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
-            }
-            while(!(n%7)){
-                ++exp;
-                n/=7;
-            }
-            if(exp){
-                factors[numfacs]=7;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
-            }
-            while(!(n%11)){
-                ++exp;
-                n/=11;
+        bool empty() const {
+            return !n;
+        }
+        unsigned long long back() const {
+            return last;
+        }
+        unsigned long long operator[](size_t i) const {
+            const Checkpoint& c=checkpoints[i>>7];
+            const unsigned char* g=gaps.data()+(c.offset&~escaped);
+            unsigned long long p=c.prime;
+            unsigned int k=i&127;
+            if(c.offset&escaped){
+                for(; k; --k)
+                    p+=gap(g);
+                return p;
+            }
+            // Without any 3 byte gaps, it's just the sum of the bytes, which goes 8 at a time
+            unsigned long long sum=p==2 && k;
+            for(; k>=8; k-=8, g+=8){
+                unsigned long long w;
+                memcpy(&w,g,8);
+                w=(w&0x00FF00FF00FF00FFULL)+(w>>8&0x00FF00FF00FF00FFULL);
+                sum+=2*(w*0x0001000100010001ULL>>48);
+            }
+            for(; k; --k)
+                sum+=2*(unsigned long long)*g++;
+            return p+sum;
+        }
+        const_iterator begin() const {
+            const_iterator it;
+            it.g=gaps.data();
+            it.p=n ? checkpoints[0].prime : 0;
+            it.i=0;
+            it.n=n;
+            return it;
+        }
+        const_iterator end() const {
+            const_iterator it;
+            it.g=0;
+            it.p=0;
+            it.i=n;
+            it.n=n;
+            return it;
+        }
+        // p has to be larger than back(), by less than 131072, which the gap to the next prime always is below 2^64
+        void push_back(unsigned long long p){
+            if(n){
+                // the gaps after 3 are all even, so they're stored halved; 0 is the gap from 2 to 3, and 255 means the next two bytes hold it
+                unsigned long long half=(p-last)/2;
+                if(half<255)
+                    gaps.push_back(half);
+                else{
+                    gaps.push_back(255);
+                    gaps.push_back(half&255);
+                    gaps.push_back(half>>8);
+                    checkpoints.back().offset|=escaped;
+                }
             }
-            if(exp){
-                factors[numfacs]=11;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
+            if(!(n&127))
+                checkpoints.push_back(Checkpoint{p,gaps.size()});
+            last=p;
+            ++n;
+        }
+        void reserve(size_t count){
+            gaps.reserve(count);
+            checkpoints.reserve(count/128+1);
+        }
+        void clear(){
+            gaps.clear();
+            checkpoints.clear();
+            n=0;
+            last=0;
+        }
+        // The memory it takes, in bytes
+        size_t bytes() const {
+            return gaps.capacity()+checkpoints.capacity()*sizeof(Checkpoint);
+        }
+
+    private:
+        struct Checkpoint {
+            unsigned long long prime;
+            // the top bit is set if any gap up to the next checkpoint takes 3 bytes
+            size_t offset;
+        };
+        static constexpr size_t escaped=~(~(size_t)0>>1);
+        std::vector<unsigned char> gaps;
+        std::vector<Checkpoint> checkpoints;
+        size_t n=0;
+        unsigned long long last=0;
+
+        static unsigned long long gap(const unsigned char*& g){
+            unsigned int half=*g++;
+            if(half==255){
+                half=g[0]|g[1]<<8;
+                g+=2;
             }
-            while(!(n%13)){
-                ++exp;
-                n/=13;
+            return half ? 2*half : 1;
+        }
+};
+
+#ifdef ZMATH_STATS
+// The things a PrimeData counts when ZMATH_STATS is defined. See stats().
+enum PrimeStat {
+    // Calls to each group of functions, with every [Small], [Unsafe], and [Wheel] version counted together,
+    // including the calls the functions make to each other. The batch functions count numbers instead of calls.
+    IsPrimeCalls, IsPrimeBatchNumbers, FactorCalls, NumPrimesUpToCalls, PrimesUpToCalls, FirstPrimesCalls, NthPrimeCalls,
+    ForEachPrimeCalls, SieveRangeCalls, FactorRangeCalls, BuildSieveToCalls,
+    // How many times the stored sieve was extended, and how many of those had to move it to a bigger mapping
+    SieveExtensions, SieveResizes,
+    BitsCrossedOff,
+    // Nanoseconds in each phase, added up over all the threads. Decoding includes whatever forEachPrime calls.
+    BasePrimeNanos, CrossOffNanos, DecodeNanos,
+    // Cache and branch misses during those phases, after enableHardwareCounters()
+    CacheMisses, BranchMisses,
+    NumPrimeStats
+};
+
+struct PrimeStats {
+    unsigned long long counts[NumPrimeStats];
+    // the memory the sieve and the rank index take up right now
+    unsigned long long sievebytes;
+    unsigned long long rankbytes;
+
+    unsigned long long operator[](PrimeStat s) const {
+        return counts[s];
+    }
+    static const char* name(PrimeStat s){
+        static const char* names[NumPrimeStats]={
+            "isPrime calls","isPrimeBatch numbers","factor calls","numPrimesUpTo calls","primesUpTo calls","firstPrimes calls","nthPrime calls",
+            "forEachPrime calls","sieveRange calls","factorRange calls","buildSieveTo calls",
+            "sieve extensions","sieve resizes","bits crossed off",
+            "base prime ns","cross off ns","decode ns",
+            "cache misses","branch misses"
+        };
+        return names[s];
+    }
+    void print(FILE* out) const {
+        for(unsigned int i=0; i<NumPrimeStats; ++i)
+            fprintf(out,"%s: %llu\n",name((PrimeStat)i),counts[i]);
+        fprintf(out,"sieve bytes: %llu\nrank bytes: %llu\n",sievebytes,rankbytes);
+    }
+};
+
+#ifdef __linux__
+// One thread's cache miss and branch miss counters, from perf_event_open. Each thread opens its own the first time it's asked,
+// since the sieve is crossed off on several threads.
+struct HardwareCounters {
+    int fds[2];
+
+    HardwareCounters(){
+        const unsigned long long events[2]={PERF_COUNT_HW_CACHE_MISSES,PERF_COUNT_HW_BRANCH_MISSES};
+        for(unsigned int i=0; i<2; ++i){
+            perf_event_attr attr;
+            memset(&attr,0,sizeof(attr));
+            attr.type=PERF_TYPE_HARDWARE;
+            attr.size=sizeof(attr);
+            attr.config=events[i];
+            attr.exclude_kernel=1;
+            attr.exclude_hv=1;
+            fds[i]=syscall(SYS_perf_event_open,&attr,0,-1,-1,0);
+        }
+    }
+    ~HardwareCounters(){
+        for(unsigned int i=0; i<2; ++i){
+            if(fds[i]>=0)
+                close(fds[i]);
+        }
+    }
+    bool working() const {
+        return fds[0]>=0 && fds[1]>=0;
+    }
+    void read(unsigned long long* counts) const {
+        for(unsigned int i=0; i<2; ++i){
+            if(fds[i]<0 || ::read(fds[i],&counts[i],8)!=8)
+                counts[i]=0;
+        }
+    }
+    static HardwareCounters& thisThread(){
+        static thread_local HardwareCounters counters;
+        return counters;
+    }
+};
+#endif
+
+#define ZMATH_COUNT(stat,n) statcounters.add(stat,n)
+#define ZMATH_TIME(phase) PhaseTimer phasetimer(statcounters,phase)
+#else
+#define ZMATH_COUNT(stat,n)
+#define ZMATH_TIME(phase)
+#endif
+
+class ConcurrentPrimeData;
+
+class PrimeData {
+    friend class ConcurrentPrimeData;
+    public:
+        PrimeData(){
+            // assign, rather than resize, so that the first word comes from malloc instead of a mapping of its own
+            sieve.assign(1);
+            sieve.reset(0);
+        }
+
+        void setThreads(unsigned int n){
+            if(!n)
+                n=std::thread::hardware_concurrency();
+            threads=n ? n : 1;
+        }
+
+        // What the last function that needed memory did about it
+        enum Strategy {
+            // answered from the stored sieve, which it grew if it had to
+            StoredSieve,
+            // sieved the range one window at a time, with the stored sieve only up to sqrt of the end of it
+            WindowedSieve,
+            // tested (or factored) the numbers one at a time, which takes no memory, but is a lot slower
+            PrimalityTests,
+            // stopped short where the memory limit ran out: the sieve, the window, or the vector doesn't go all the way
+            PartialResult
+        };
+        // Caps the memory taken by the sieve, the rank index, and the windows and vectors that the functions fill, in bytes.
+        // 0, the default, means no limit.
+        void setMemoryLimit(unsigned long long bytes){
+            memorylimit=bytes;
+        }
+        Strategy lastStrategy() const {
+            return (Strategy)strategy.value.load(std::memory_order_relaxed);
+        }
+
+        // From now on, keep a count of the primes before every cache line of the sieve,
+        // so numPrimesUpTo on the part that's already sieved takes constant time.
+        // Returns false, and doesn't build it, if the index would go over the memory limit
+        bool buildRankIndex(){
+            if(!ranked && memorylimit && storedBytes(maxstored)/4*5>memorylimit)
+                return false;
+            ranked=true;
+            updateRanks();
+            return true;
+        }
+
+        // Returns false if the memory limit stopped it short of n. It still goes as far as the limit allows.
+        bool buildSieveTo(unsigned long long n){
+            ZMATH_COUNT(BuildSieveToCalls,1);
+            bool whole=fits(n);
+            if(!whole)
+                n=std::max(largestFit(),maxstored);
+            setStrategy(whole ? StoredSieve : PartialResult);
+            sieveTo(n);
+            return whole;
+        }
+        // The same as buildSieveTo(n), except that it starts from the snapshot at path if there's a good one there,
+        // and if it has to sieve past what the snapshot had, it saves the new sieve back to path.
+        bool buildSieveTo(unsigned long long n, const char* path){
+            loadSieve(path);
+            unsigned long long before=maxstored;
+            bool whole=buildSieveTo(n);
+            if(maxstored>before)
+                saveSieve(path);
+            return whole;
+        }
+
+        // Writes the sieve to path, along with the wheel tables and how far it goes. Returns false if it couldn't.
+        // It's written to a temporary file first and then renamed, so anything reading the old file at the same time is fine.
+        bool saveSieve(const char* path){
+            SnapshotHeader header;
+            fillHeader(header);
+            header.maxsieve=maxsieve;
+            header.maxbigsieve=maxbigsieve;
+            header.numwords=sieve.size()/64;
+            std::string temp=std::string(path)+".tmp";
+            FILE* file=fopen(temp.c_str(),"wb");
+            if(!file)
+                return false;
+            bool ok=fwrite(&header,sizeof(header),1,file)==1
+                && fwrite(&SharedWheelTables<>::tables,sizeof(WheelTables),1,file)==1;
+            static const char zeros[4096]={0};
+            ok=ok && fwrite(zeros,1,snapshotoffset-sizeof(header)-sizeof(WheelTables),file)==snapshotoffset-sizeof(header)-sizeof(WheelTables);
+            ok=ok && fwrite(sieve.data(),8,header.numwords,file)==header.numwords;
+            ok=(fclose(file)==0) && ok;
+            if(!ok || rename(temp.c_str(),path)){
+                remove(temp.c_str());
+                return false;
             }
-            if(exp){
-                factors[numfacs]=13;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
-            }
-            unsigned int b = 1;
-            unsigned long long p = 17;
-            while(p*p<=n){
-                while(!(n%p)){
-                    ++exp;
-                    n/=p;
-                }
-                if(exp){
-                    factors[numfacs]=p;
-                    exponents[numfacs]=exp;
-                    ++numfacs;
-                    exp=0;
+            return true;
+        }
+        // Maps in a sieve that saveSieve wrote, in place of the one that's here. This takes milliseconds no matter how big it is,
+        // since the pages are only read in from the file (or the page cache) when they're used.
+        // Returns false, and leaves everything the way it was, if the file is missing, truncated, from a different version or machine,
+        // or doesn't go any further than the sieve that's already here.
+        bool loadSieve(const char* path){
+            int fd=open(path,O_RDONLY);
+            if(fd<0)
+                return false;
+            bool ok=attachSnapshot(fd);
+            close(fd);
+            return ok;
+        }
+
+        // These all go through isPrimeWith and factorWith, which are compiled separately for each integer type and lookup,
+        // so the Small versions do 32-bit arithmetic all the way through, and none of them check which one they are at run time.
+        bool isPrime(unsigned long long n){
+            return isPrimeWith<unsigned long long,Grow>(n);
+        }
+        bool isPrimeUnsafe(unsigned long long n){
+            return isPrimeWith<unsigned long long,Unsafe>(n);
+        }
+        bool isPrimeSmall(unsigned int n){
+            return isPrimeWith<unsigned int,Grow>(n);
+        }
+        bool isPrimeSmallUnsafe(unsigned int n){
+            return isPrimeWith<unsigned int,Unsafe>(n);
+        }
+        bool isPrimeWheel(unsigned long long n){
+            return isPrimeWith<unsigned long long,Wheel>(n);
+        }
+        bool isPrimeSmallWheel(unsigned int n){
+            return isPrimeWith<unsigned int,Wheel>(n);
+        }
+
+        // Sets out[i] to isPrime(in[i]) for i from 0 to n-1, without extending the sieve.
+        // The sieve words for a block of queries are all prefetched before any of them are read, so the cache misses overlap.
+        // With sorted, the lookups go in sieve order instead, which turns the misses into one pass over the sieve,
+        // at the cost of sorting. That only pays off when there are more queries than the sieve has cache lines.
+        void isPrimeBatch(const unsigned long long* in, size_t n, unsigned char* out, bool sorted=false){
+            isPrimeBatchWith(in,n,out,sorted);
+        }
+        void isPrimeSmallBatch(const unsigned int* in, size_t n, unsigned char* out, bool sorted=false){
+            isPrimeBatchWith(in,n,out,sorted);
+        }
+
+        unsigned char factor(unsigned long long n, unsigned long long* factors, unsigned char* exponents){
+            return factorWith<unsigned long long,Grow>(n,factors,exponents);
+        }
+        unsigned char factorUnsafe(unsigned long long n, unsigned long long* factors, unsigned char* exponents){
+            return factorWith<unsigned long long,Unsafe>(n,factors,exponents);
+        }
+        unsigned char factorWheel(unsigned long long n, unsigned long long* factors, unsigned char* exponents){
+            return factorWith<unsigned long long,Wheel>(n,factors,exponents);
+        }
+        unsigned char factorSmall(unsigned int n, unsigned int* factors, unsigned char* exponents){
+            return factorWith<unsigned int,Grow>(n,factors,exponents);
+        }
+        unsigned char factorSmallUnsafe(unsigned int n, unsigned int* factors, unsigned char* exponents){
+            return factorWith<unsigned int,Unsafe>(n,factors,exponents);
+        }
+        unsigned char factorSmallWheel(unsigned int n, unsigned int* factors, unsigned char* exponents){
+            return factorWith<unsigned int,Wheel>(n,factors,exponents);
+        }
+
+        // Calls f(n, factors, exponents, numfacs) for every n from lo to hi, in order,
+        // where the arrays are filled in the same way as factor(n,factors,exponents) would, and numfacs is its return value.
+        template<class F> void factorRange(unsigned long long lo, unsigned long long hi, F f){
+            ZMATH_COUNT(FactorRangeCalls,1);
+            if(lo>hi)
+                return;
+            if(!growSieveTo(isqrt(hi)+1)){
+                // Past the memory limit, each number is factored on its own, which only needs the primes below trialbound
+                setStrategy(PrimalityTests);
+                unsigned long long factors[15];
+                unsigned char exponents[15];
+                for(unsigned long long n=lo; ; ++n){
+                    f(n,factors,exponents,n ? factor(n,factors,exponents) : 0);
+                    if(n==hi)
+                        break;
                 }
-                ++b;
-                while(!sieve[b])
-                    ++b;
-                p = b/5760*30030+conversions[b%5760];
+                return;
             }
-            if(n>1){
-                factors[numfacs]=n;
-                exponents[numfacs]=1;
-                ++numfacs;
+            setStrategy(WindowedSieve);
+            std::vector<unsigned long long> rest(rangesegment);
+            std::vector<unsigned long long> factors(rangesegment*15);
+            std::vector<unsigned char> exponents(rangesegment*15);
+            std::vector<unsigned char> numfacs(rangesegment);
+            for(unsigned long long seg=lo; ; seg+=rangesegment){
+                unsigned long long len=std::min(hi-seg,rangesegment-1ULL)+1;
+                for(unsigned long long i=0; i<len; ++i){
+                    rest[i]=seg+i;
+                    numfacs[i]=0;
+                }
+                // 0 doesn't get any factors
+                if(!seg)
+                    rest[0]=1;
+                forEachRangePrime(seg,len,[&](unsigned long long p, unsigned long long i){
+                    unsigned char e=0;
+                    do{
+                        rest[i]/=p;
+                        ++e;
+                    }while(!(rest[i]%p));
+                    factors[i*15+numfacs[i]]=p;
+                    exponents[i*15+numfacs[i]]=e;
+                    ++numfacs[i];
+                });
+                for(unsigned long long i=0; i<len; ++i){
+                    if(rest[i]>1){
+                        factors[i*15+numfacs[i]]=rest[i];
+                        exponents[i*15+numfacs[i]]=1;
+                        ++numfacs[i];
+                    }
+                    f(seg+i,&factors[i*15],&exponents[i*15],numfacs[i]);
+                }
+                if(hi-seg<rangesegment)
+                    break;
             }
-            return numfacs;
         }
-        unsigned char factorWheel(unsigned long long n, unsigned long long* factors, unsigned char* exponents){
-            unsigned char exp=0;
-            unsigned char numfacs=0;
-            while(!(n&1U)){
-                ++exp;
-                n>>=1;
-            }
-            if(exp){
-                factors[0]=2;
-                exponents[0]=exp;
-                numfacs=1;
-                exp=0;
+        // Sets spf[n-lo] to the smallest prime factor of every n from lo to hi, or n itself if it's prime.
+        // 0 and 1 are their own smallest factors. spf must have room for hi-lo+1 numbers.
+        void smallestFactors(unsigned long long lo, unsigned long long hi, unsigned long long* spf){
+            ZMATH_COUNT(FactorRangeCalls,1);
+            if(lo>hi)
+                return;
+            if(!growSieveTo(isqrt(hi)+1)){
+                setStrategy(PrimalityTests);
+                unsigned long long factors[15];
+                unsigned char exponents[15];
+                for(unsigned long long n=lo; ; ++n){
+                    spf[n-lo]=n>1 ? (factor(n,factors,exponents),factors[0]) : n;
+                    if(n==hi)
+                        break;
+                }
+                return;
             }
-            while(!(n%3)){
-                ++exp;
-                n/=3;
+            setStrategy(WindowedSieve);
+            for(unsigned long long seg=lo; ; seg+=rangesegment){
+                unsigned long long len=std::min(hi-seg,rangesegment-1ULL)+1;
+                unsigned long long* s=spf+(seg-lo);
+                for(unsigned long long i=0; i<len; ++i)
+                    s[i]=0;
+                if(!seg)
+                    s[0]=1;
+                forEachRangePrime(seg,len,[&](unsigned long long p, unsigned long long i){
+                    if(!s[i])
+                        s[i]=p;
+                });
+                for(unsigned long long i=0; i<len; ++i){
+                    if(!s[i])
+                        s[i]=seg+i;
+                }
+                if(!seg)
+                    s[0]=0;
+                if(hi-seg<rangesegment)
+                    break;
             }
-            if(exp){
-                factors[numfacs]=3;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
+        }
+        // Calls f(p) for every prime p from lo to hi, in order, without storing them.
+        // The part that's already sieved is read straight out of the sieve, and the rest is sieved one window at a time,
+        // so it only ever needs the sieve up to sqrt(hi).
+        template<class F> void forEachPrime(unsigned long long lo, unsigned long long hi, F f){
+            ZMATH_COUNT(ForEachPrimeCalls,1);
+            // 2^64-1 isn't prime, and this way hi+1 doesn't overflow
+            hi=std::min(hi,~0ULL-1);
+            const unsigned int firstsix[6]={2,3,5,7,11,13};
+            for(unsigned int k=0; k<6; ++k){
+                if(firstsix[k]>=lo && firstsix[k]<=hi)
+                    f((unsigned long long)firstsix[k]);
+            }
+            lo=std::max(lo,17ULL);
+            if(lo>hi)
+                return;
+            if(lo<=maxstored){
+                setStrategy(StoredSieve);
+                unsigned long long last=std::min(hi,maxstored)+1;
+                decodeWords(sieve,0,lo/30030*5760+indexes[lo%30030],last/30030*5760+indexes[last%30030],f);
+                if(hi<=maxstored)
+                    return;
+                lo=maxstored+1;
+            }
+            // If the range is narrow next to sqrt(hi), starting up every prime up to sqrt(hi) takes longer than testing each number.
+            // The same goes when the primes up to sqrt(hi) won't fit in the memory limit.
+            if(hi-lo<isqrt(hi)/64 || !growSieveTo(isqrt(hi)+1)){
+                setStrategy(PrimalityTests);
+                for(unsigned long long b=lo/30030*5760+indexes[lo%30030]; ; ++b){
+                    unsigned long long q=b/5760*30030+conversions[b%5760];
+                    // (q can only go below lo by wrapping around past 2^64)
+                    if(q>hi || q<lo)
+                        break;
+                    if(q<289 || isProbablePrime(q))
+                        f(q);
+                }
+                return;
             }
-            while(!(n%5)){
-                ++exp;
-                n/=5;
+            setStrategy(WindowedSieve);
+            unsigned long long start=lo-lo%30030;
+            std::vector<SievePrime> primes;
+            SieveBuckets buckets;
+            basePrimes(start,hi,primes,buckets);
+            WheelBitset window;
+            // the last wheel period below 2^64 doesn't fit in a window, so it's left for later
+            unsigned long long top=~0ULL-~0ULL%30030;
+            while(start<=hi && start<top){
+                unsigned long long winhi=std::min(std::min(hi+1,top),top-start>segmentblocks*30030ULL ? start+segmentblocks*30030ULL : top);
+                if(winhi%30030)
+                    winhi+=30030-winhi%30030;
+                unsigned long long offset=start/30030*5760;
+                window.assign((winhi-start)/30030*5760);
+                {
+                    ZMATH_TIME(CrossOffNanos);
+                    presieve(window,offset,start,winhi);
+                    for(unsigned int i=0; i<primes.size(); ++i)
+                        crossOff(window,offset,winhi,primes[i]);
+                    crossOffBucket(buckets,window,offset,winhi);
+                }
+                unsigned long long first=std::max(start,lo);
+                unsigned long long last=std::min(winhi,hi+1);
+                decodeWords(window,offset,first/30030*5760+indexes[first%30030]-offset,last/30030*5760+indexes[last%30030]-offset,f);
+                start=winhi;
             }
-            if(exp){
-                factors[numfacs]=5;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
+            for(unsigned int i=0; i<5760 && hi>=top && top+conversions[i]>=top && top+conversions[i]<=hi; ++i){
+                if(top+conversions[i]>=lo && isProbablePrime(top+conversions[i]))
+                    f(top+conversions[i]);
             }
-            while(!(n%7)){
-                ++exp;
-                n/=7;
+        }
+
+        // Sieves just [lo, hi], with the primes up to sqrt(hi), so it only needs the sieve up to sqrt(hi)
+        PrimeWindow sieveRange(unsigned long long lo, unsigned long long hi){
+            ZMATH_COUNT(SieveRangeCalls,1);
+            PrimeWindow window;
+            // 2^64-1 isn't prime, and this way hi+1 doesn't overflow
+            hi=std::min(hi,~0ULL-1);
+            if(lo>hi)
+                return window;
+            bool sieved=growSieveTo(isqrt(hi)+1);
+            setStrategy(sieved ? WindowedSieve : PrimalityTests);
+            unsigned long long start=lo-lo%30030;
+            // The window itself takes 720 bytes per wheel period. Past the memory limit (but never less than one segment), it stops short.
+            if(memorylimit){
+                unsigned long long periods=std::max(roomLeft(),segmentblocks*720ULL)/720;
+                if((hi-start)/30030>=periods){
+                    hi=start+periods*30030-1;
+                    setStrategy(PartialResult);
+                    if(lo>hi)
+                        return window;
+                }
             }
-            if(exp){
-                factors[numfacs]=7;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
+            // the last wheel period below 2^64 can't be rounded up to, so it's tested one number at a time
+            unsigned long long top=~0ULL-~0ULL%30030;
+            unsigned long long end=hi>=top ? top : hi+1;
+            if(end%30030)
+                end+=30030-end%30030;
+            window.from=lo;
+            window.to=hi;
+            window.offset=start/30030*5760;
+            window.bits.assign((end-start)/30030*5760+(hi>=top ? 5760 : 0));
+            if(!start)
+                window.bits.reset(0);
+            if(!sieved){
+                for(unsigned long long b=lo/30030*5760+indexes[lo%30030]; ; ++b){
+                    unsigned long long q=b/5760*30030+conversions[b%5760];
+                    if(q>hi || q<lo)
+                        break;
+                    if(q>=289 && !isProbablePrime(q))
+                        window.bits.reset(b-window.offset);
+                }
+                return window;
+            }
+            std::vector<SievePrime> primes;
+            SieveBuckets buckets;
+            basePrimes(start,hi,primes,buckets);
+            for(unsigned long long seg=start; seg<end; ){
+                ZMATH_TIME(CrossOffNanos);
+                unsigned long long seghi=end-seg>segmentblocks*30030ULL ? seg+segmentblocks*30030ULL : end;
+                presieve(window.bits,window.offset,seg,seghi);
+                for(unsigned int i=0; i<primes.size(); ++i)
+                    crossOff(window.bits,window.offset,seghi,primes[i]);
+                crossOffBucket(buckets,window.bits,window.offset,seghi);
+                seg=seghi;
+            }
+            for(unsigned int i=0; i<5760 && hi>=top && top+conversions[i]>=top && top+conversions[i]<=hi; ++i){
+                if(!isProbablePrime(top+conversions[i]))
+                    window.bits.reset((top-start)/30030*5760+i);
+            }
+            return window;
+        }
+        // Fills primes with the primes from lo to hi, and returns how many there are
+        unsigned long long primesInRange(unsigned long long lo, unsigned long long hi, std::vector<unsigned long long>& primes){
+            primes.clear();
+            bool whole=fitOutput(lo,hi,8);
+            forEachPrime(lo,hi,[&](unsigned long long p){
+                primes.push_back(p);
+            });
+            if(!whole)
+                setStrategy(PartialResult);
+            return primes.size();
+        }
+
+        unsigned long long primesUpTo(unsigned long long n, std::vector<unsigned long long>& primes){
+            ZMATH_COUNT(PrimesUpToCalls,1);
+            primes.clear();
+            bool whole=fitOutput(0,n,8);
+            if(n>=60184)
+                primes.reserve((unsigned long long)(n/(log(n)-1.1)));
+            else if(n>=17)
+                primes.reserve((unsigned int)(1.25506*n/log(n)));
+            forEachPrime(0,n,[&](unsigned long long p){
+                primes.push_back(p);
+            });
+            if(!whole)
+                setStrategy(PartialResult);
+            return primes.size();
+        }
+        unsigned long long primesUpTo(unsigned long long n, PrimeList& primes){
+            ZMATH_COUNT(PrimesUpToCalls,1);
+            primes.clear();
+            bool whole=fitOutput(0,n,1.13);
+            if(n>=60184)
+                primes.reserve((unsigned long long)(n/(log(n)-1.1)));
+            else if(n>=17)
+                primes.reserve((unsigned int)(1.25506*n/log(n)));
+            forEachPrime(0,n,[&](unsigned long long p){
+                primes.push_back(p);
+            });
+            if(!whole)
+                setStrategy(PartialResult);
+            return primes.size();
+        }
+        unsigned int primesUpToSmall(unsigned int n, std::vector<unsigned int>& primes){
+            ZMATH_COUNT(PrimesUpToCalls,1);
+            primes.clear();
+            unsigned long long hi=n;
+            bool whole=fitOutput(0,hi,4);
+            n=hi;
+            if(n>=60184)
+                primes.reserve((unsigned int)(n/(log(n)-1.1)));
+            else if(n>=17)
+                primes.reserve((unsigned int)(1.25506*n/log(n)));
+            forEachPrime(0,n,[&](unsigned long long p){
+                primes.push_back(p);
+            });
+            if(!whole)
+                setStrategy(PartialResult);
+            return primes.size();
+        }
+
+        unsigned long long numPrimesUpTo(unsigned long long n){
+            ZMATH_COUNT(NumPrimesUpToCalls,1);
+            if(n>=17){
+                if(!growSieveTo(sqrt(n)+1)){
+                    // the primes up to sqrt(n) don't fit in the memory limit, so they're counted one test at a time
+                    unsigned long long t=0;
+                    forEachPrime(0,n,[&](unsigned long long){
+                        ++t;
+                    });
+                    return t;
+                }
+                if(n<=maxstored){
+                    setStrategy(StoredSieve);
+                    return countStored(n);
+                }
+                // LMO takes about as long as sieving 2*n^(2/3) numbers, so past that, it's quicker than counting the rest
+                double lmo=cbrt(n);
+                unsigned long long t;
+                if(n>=10000000 && (n-maxstored)/threads>2*lmo*lmo)
+                    t=countLMO(n);
+                else
+                    t=countStored(maxstored)+countParallel(maxstored,n);
+                // (after, since LMO counts smaller ranges along the way)
+                setStrategy(WindowedSieve);
+                return t;
+            }else if(n>=13)
+                return 6;
+            else if(n>=11)
+                return 5;
+            else if(n>=7)
+                return 4;
+            else if(n>=5)
+                return 3;
+            else if(n>=3)
+                return 2;
+            else if(n>=2)
+                return 1;
+            else
+                return 0;
+        }
+        unsigned int numPrimesUpToSmall(unsigned int n){
+            return numPrimesUpTo(n);
+        }
+        unsigned long long numPrimesUpToLMO(unsigned long long n){
+            if(n<1000)
+                return numPrimesUpTo(n);
+            ZMATH_COUNT(NumPrimesUpToCalls,1);
+            unsigned long long t=countLMO(n);
+            // If the sieve doesn't reach sqrt(n), countLMO fell back on numPrimesUpTo, which already said what it did
+            if(isqrt(n)<=maxstored)
+                setStrategy(WindowedSieve);
+            return t;
+        }
+
+        void firstPrimes(unsigned long long n, std::vector<unsigned long long>& primes){
+            ZMATH_COUNT(FirstPrimesCalls,1);
+            primes.clear();
+            unsigned long long wanted=n;
+            n=fitCount(n,8);
+            primes.reserve(n);
+            unsigned long long bound=firstPrimesBound(n);
+            forEachPrime(0,bound,[&](unsigned long long p){
+                if(primes.size()<n)
+                    primes.push_back(p);
+            });
+            if(n<wanted)
+                setStrategy(PartialResult);
+        }
+        void firstPrimes(unsigned long long n, PrimeList& primes){
+            ZMATH_COUNT(FirstPrimesCalls,1);
+            primes.clear();
+            unsigned long long wanted=n;
+            n=fitCount(n,1.13);
+            primes.reserve(n);
+            unsigned long long bound=firstPrimesBound(n);
+            forEachPrime(0,bound,[&](unsigned long long p){
+                if(primes.size()<n)
+                    primes.push_back(p);
+            });
+            if(n<wanted)
+                setStrategy(PartialResult);
+        }
+        void firstPrimesSmall(unsigned int n, std::vector<unsigned int>& primes){
+            ZMATH_COUNT(FirstPrimesCalls,1);
+            primes.clear();
+            unsigned long long wanted=n;
+            n=fitCount(n,4);
+            primes.reserve(n);
+            unsigned int bound=n<6 ? 13 : n<=194682290 ? (unsigned int)(n*log(n*log(n))) : 4289995710U;
+            forEachPrime(0,bound,[&](unsigned long long p){
+                if(primes.size()<n)
+                    primes.push_back(p);
+            });
+            if(n<wanted)
+                setStrategy(PartialResult);
+        }
+        // The kth prime, counting from nthPrime(1)=2, or 0 if k is 0 or there aren't k primes below 2^64
+        unsigned long long nthPrime(unsigned long long k){
+            ZMATH_COUNT(NthPrimeCalls,1);
+            const unsigned int firstsix[6]={2,3,5,7,11,13};
+            if(!k || k>425656284035217743ULL)
+                return 0;
+            if(k<=6)
+                return firstsix[k-1];
+            double guess=inverseLi(k);
+            unsigned long long x=guess>=18446744073709549568.0 ? ~0ULL-1 : std::max((unsigned long long)guess,17ULL);
+            unsigned long long c=numPrimesUpTo(x);
+            double logx=log((double)x);
+            // pi(x) is within about sqrt(x)/log(x) of li(x), so the kth prime is only that many primes' worth of gaps away.
+            // Windows are sized to cover the miss with some slack, and keep going the same way if it still falls short.
+            while(true){
+                unsigned long long miss=c>k ? c-k : k-c;
+                unsigned long long d=(unsigned long long)((miss+16)*logx*1.25)+30030;
+                // sieveRange can always fit one segment, even when there's no room left under the memory limit
+                if(memorylimit)
+                    d=std::min(d,segmentblocks*30030ULL);
+                if(c>=k){
+                    unsigned long long lo=x>d ? x-d+1 : 0;
+                    PrimeWindow window=sieveRange(lo,x);
+                    unsigned long long below=c-window.numPrimes();
+                    if(below<k)
+                        return window.nthPrime(k-below);
+                    c=below;
+                    x=lo-1;
+                }else{
+                    unsigned long long hi=~0ULL-1-x>d ? x+d : ~0ULL-1;
+                    PrimeWindow window=sieveRange(x+1,hi);
+                    unsigned long long inside=window.numPrimes();
+                    if(c+inside>=k)
+                        return window.nthPrime(k-c);
+                    c+=inside;
+                    x=hi;
+                }
             }
-            while(!(n%11)){
-                ++exp;
-                n/=11;
+        }
+
+#ifdef ZMATH_STATS
+        // What this PrimeData has done since it was made, or since resetStats(), and how much memory it holds now
+        PrimeStats stats() const {
+            PrimeStats s;
+            for(unsigned int i=0; i<NumPrimeStats; ++i)
+                s.counts[i]=statcounters.counts[i].load(std::memory_order_relaxed);
+            s.sievebytes=sieve.bytes();
+            s.rankbytes=ranks.capacity()*sizeof(RankLine);
+            return s;
+        }
+        void resetStats(){
+            statcounters.reset();
+        }
+        // Starts counting cache and branch misses in the sieve phases too. Returns false if the kernel doesn't allow it.
+        bool enableHardwareCounters(){
+#ifdef __linux__
+            statcounters.hardware=HardwareCounters::thisThread().working();
+#endif
+            return statcounters.hardware;
+        }
+#endif
+
+    private:
+        static constexpr const unsigned short* conversions = SharedWheelTables<>::tables.conversions;
+        static constexpr const unsigned char* wheel = SharedWheelTables<>::tables.wheel;
+        static constexpr const unsigned short* indexes = SharedWheelTables<>::tables.indexes;
+        unsigned int maxsieve = 0;
+        unsigned long long maxbigsieve = 4289995710U;
+        // The highest number the sieve covers, whichever part of it that's in
+        unsigned long long maxstored = 0;
+        unsigned int maxbool = 1;
+        unsigned long long maxbigbool = 0;
+        unsigned int threads = 1;
+        // Bit b is the number b/5760*30030+conversions[b%5760]. Above 4289995710 it's the "big sieve".
+        WheelBitset sieve;
+
+        // Base primes carry their next multiple s and wheel position w from one segment to the next,
+        // so each segment only needs the primes up to its own square root.
+        struct SievePrime {
+            unsigned long long s;
+            unsigned int p;
+            unsigned short w;
+        };
+        // Oliveira e Silva's bucket sieve. A step around the wheel averages 30030/5760 p, so a prime above bucketbound hits
+        // less than once per segment. Instead of being checked every segment, each of those waits in the bucket for the segment
+        // its next multiple is in, so a segment only touches the primes that actually hit it. Segment k is [lo+k*span, lo+(k+1)*span),
+        // and the buckets go around in a circle, since no prime can skip more of them than there are.
+        struct SieveBuckets {
+            std::vector<std::vector<SievePrime> > buckets;
+            std::vector<SievePrime> spare;
+            unsigned long long lo;
+            unsigned long long segment;
+        };
+        // A snapshot file is this header, then conversions, wheel, and indexes, then the sieve words starting at snapshotoffset,
+        // which is a multiple of the page size so they can be mapped in directly.
+        struct SnapshotHeader {
+            char magic[8];
+            unsigned int version;
+            unsigned int headersize;
+            unsigned long long byteorder;
+            unsigned long long maxsieve;
+            unsigned long long maxbigsieve;
+            unsigned long long numwords;
+        };
+        static const unsigned int snapshotversion = 1;
+        static const unsigned long long snapshotoffset = 81920;
+
+        // 32 wheel periods is 23040 bytes of sieve, which fits in L1 along with the wheel tables.
+        static const unsigned int segmentblocks = 32;
+        // primes above a quarter of a segment go in the buckets
+        static const unsigned int bucketbound = segmentblocks*30030/4;
+        // factor only trial divides up to here before switching to Pollard-Brent rho
+        static const unsigned int trialbound = 1000;
+        // factorRange keeps 15 factors for each number in a segment, so this is about 4.5 MB
+        static const unsigned int rangesegment = 32768;
+        std::vector<SievePrime> sieveprimes;
+        unsigned int sievebase = 1;
+
+        static const PresievePatterns& presievePatterns(){
+            static const PresievePatterns patterns;
+            return patterns;
+        }
+        // The presieved primes don't go in any list of base primes
+        static const unsigned int presieved = 61;
+        // Starts [lo, hi) of bits off with the multiples of the presieved primes crossed off, and nothing else,
+        // where lo and hi are multiples of 30030, and bit b is the number (b+offset)/5760*30030+conversions[(b+offset)%5760].
+        void presieve(WheelBitset& bits, unsigned long long offset, unsigned long long lo, unsigned long long hi){
+            const PresievePatterns& patterns=presievePatterns();
+            unsigned long long first=lo/30030;
+            unsigned long long periods=hi/30030-first;
+            unsigned long long word=first*90-offset/64;
+            for(unsigned int k=0; k<PresievePatterns::count; ++k){
+                unsigned int p=patterns.primes[k];
+                // the pattern wraps around at most once per segment, but a longer range just keeps going around
+                for(unsigned long long i=0, o=first%p; i<periods; o=0){
+                    unsigned long long n=std::min(periods-i,p-o);
+                    if(k)
+                        bits.andWords(word+i*90,&patterns.words[k][o*90],n*90);
+                    else
+                        bits.copyWords(word+i*90,&patterns.words[k][o*90],n*90);
+                    i+=n;
+                }
             }
-            if(exp){
-                factors[numfacs]=11;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
+            // 1 isn't prime, but the presieved primes are
+            if(!lo){
+                bits.reset(0);
+                for(unsigned int k=0; k<PresievePatterns::count; ++k)
+                    bits.set(indexes[patterns.primes[k]]);
             }
-            while(!(n%13)){
-                ++exp;
-                n/=13;
+        }
+        // s starts out at the first multiple of p that is at least lo and p^2,
+        // and isn't divisible by 2, 3, 5, 7, 11, or 13
+        void startSievePrime(SievePrime& sp, unsigned long long lo){
+            unsigned long long q=lo/sp.p+(lo%sp.p!=0);
+            if(q<sp.p)
+                q=sp.p;
+            sp.w=indexes[q%30030];
+            unsigned long long m=q-q%30030+conversions[sp.w];
+            // Near 2^64 that multiple might not fit, and then there's nothing left for p to cross off
+            sp.s=m>~0ULL/sp.p ? ~0ULL : sp.p*m;
+        }
+        void crossOff(WheelBitset& bits, unsigned long long offset, unsigned long long hi, SievePrime& sp){
+            unsigned long long s=sp.s;
+            unsigned long long p=sp.p;
+            unsigned short w=sp.w;
+            // The biggest gap in the wheel is 22, so below this, s can't wrap around past 2^64
+            unsigned long long safe=std::min(hi,~0ULL-22*p);
+            while(s<safe){
+                bits.reset(s/30030*5760+indexes[s%30030]-offset);
+                s+=p*wheel[w];
+                ++w;
+                if(w==5760)
+                    w=0;
             }
-            if(exp){
-                factors[numfacs]=13;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
-            }
-            unsigned long long p=17;
-            unsigned short w=1;
-            while(p*p<=n){
-                while(!(n%p)){
-                    ++exp;
-                    n/=p;
-                }
-                if(exp){
-                    factors[numfacs]=p;
-                    exponents[numfacs]=exp;
-                    ++numfacs;
-                    exp=0;
-                }
-                p+=wheel[w];
+            while(s<hi){
+                bits.reset(s/30030*5760+indexes[s%30030]-offset);
+                unsigned long long step=p*wheel[w];
                 ++w;
-                w%=5760;
+                if(w==5760)
+                    w=0;
+                if(s>~0ULL-step){
+                    s=~0ULL;
+                    break;
+                }
+                s+=step;
             }
-            if(n>1){
-                factors[numfacs]=n;
-                exponents[numfacs]=1;
-                ++numfacs;
+            // every step moves one place around the wheel, and all the way around is 30030*p
+            ZMATH_COUNT(BitsCrossedOff,(s-sp.s)/p/30030*5760+(w+5760-sp.w)%5760);
+            sp.s=s;
+            sp.w=w;
+        }
+        // Gets the buckets ready to sieve [lo, hi), where lo is a multiple of 30030, one segment at a time
+        void startBuckets(SieveBuckets& sb, unsigned long long lo, unsigned long long hi){
+            const unsigned long long span=segmentblocks*30030ULL;
+            // The biggest gap in the wheel is 22, so a prime up to sqrt(hi) can't skip more than 22*sqrt(hi)/span segments
+            unsigned long long n=std::min(22*isqrt(hi)/span,(hi-lo)/span)+2;
+            sb.buckets.clear();
+            sb.buckets.resize(n);
+            sb.lo=lo;
+            sb.segment=0;
+        }
+        void addToBucket(SieveBuckets& sb, const SievePrime& sp){
+            unsigned long long k=(sp.s-sb.lo)/(segmentblocks*30030ULL);
+            // Putting a prime in too early is harmless, since crossOff just won't find anything to cross off, so past the end
+            // of the circle (or once it's gone past 2^64) it goes in the last bucket, and a short last segment leaves it in the next one
+            k=std::min(std::max(k,sb.segment),sb.segment+sb.buckets.size()-1);
+            sb.buckets[k%sb.buckets.size()].push_back(sp);
+        }
+        // Crosses off the primes waiting for the next segment, which ends at hi, and moves each of them on to the bucket for its next multiple
+        void crossOffBucket(SieveBuckets& sb, WheelBitset& bits, unsigned long long offset, unsigned long long hi){
+            sb.spare.swap(sb.buckets[sb.segment%sb.buckets.size()]);
+            ++sb.segment;
+            for(size_t i=0; i<sb.spare.size(); ++i){
+                crossOff(bits,offset,hi,sb.spare[i]);
+                addToBucket(sb,sb.spare[i]);
+            }
+            sb.spare.clear();
+        }
+
+        // Sieves [lo, hi) one segment at a time, where lo and hi are multiples of 30030.
+        // New base primes are read out of sieve as soon as a segment needs them,
+        // which is safe because everything below p^2 is already sieved.
+        void sieveSegments(unsigned long long lo, unsigned long long hi){
+            ZMATH_TIME(CrossOffNanos);
+            // sieveprimes go up in order until they're put in the buckets, and come back out after the small ones
+            SieveBuckets buckets;
+            startBuckets(buckets,lo,hi);
+            unsigned int small=sieveprimes.size();
+            while(small && sieveprimes[small-1].p>bucketbound)
+                --small;
+            for(unsigned int i=small; i<sieveprimes.size(); ++i)
+                addToBucket(buckets,sieveprimes[i]);
+            sieveprimes.resize(small);
+            while(lo<hi){
+                unsigned long long seghi=std::min(hi,lo+segmentblocks*30030ULL);
+                presieve(sieve,0,lo,seghi);
+                for(unsigned int i=0; i<sieveprimes.size(); ++i)
+                    crossOff(sieve,0,seghi,sieveprimes[i]);
+                crossOffBucket(buckets,sieve,0,seghi);
+                while(true){
+                    sievebase=sieve.next(sievebase);
+                    unsigned long long p=sievebase/5760*30030+conversions[sievebase%5760];
+                    if(p*p>=seghi)
+                        break;
+                    if(p<=presieved){
+                        ++sievebase;
+                        continue;
+                    }
+                    SievePrime sp;
+                    sp.p=p;
+                    sp.s=p*p;
+                    sp.w=indexes[p%30030];
+                    crossOff(sieve,0,seghi,sp);
+                    if(p>bucketbound)
+                        addToBucket(buckets,sp);
+                    else
+                        sieveprimes.push_back(sp);
+                    ++sievebase;
+                }
+                lo=seghi;
             }
-            return numfacs;
+            for(size_t i=0; i<buckets.buckets.size(); ++i)
+                sieveprimes.insert(sieveprimes.end(),buckets.buckets[i].begin(),buckets.buckets[i].end());
         }
-        unsigned char factorSmall(unsigned int n, unsigned int* factors, unsigned char* exponents){
-            unsigned char exp=0;
-            unsigned char numfacs=0;
-            while(!(n&1U)){
-                ++exp;
-                n>>=1;
+
+        // Counts primes up to n using what is already sieved, for 17 <= n <= maxsieve or maxbigsieve.
+        unsigned long long countStored(unsigned long long n){
+            ZMATH_TIME(DecodeNanos);
+            unsigned long long maxb=(n+1)/30030*5760+indexes[(n+1)%30030];
+            if(ranked)
+                return 6+rank(maxb);
+            if(n<=4289995710U)
+                return 6+sieve.count(1,maxb);
+            return 203056267+sieve.count(822856320,maxb);
+        }
+        // Fills primes with the base primes up to sqrt(hi) that have a multiple up to hi, started at lo,
+        // except that the ones above bucketbound go in buckets, ready to sieve [lo, hi].
+        // lo must be a multiple of 30030, and the sieve must already reach sqrt(hi).
+        void basePrimes(unsigned long long lo, unsigned long long hi, std::vector<SievePrime>& primes, SieveBuckets& buckets){
+            ZMATH_TIME(BasePrimeNanos);
+            startBuckets(buckets,lo,hi);
+            unsigned long long sqrthi=isqrt(hi);
+            for(unsigned long long b=1; ; ++b){
+                b=sieve.next(b);
+                // (past 2^32, neither b/5760*30030 in 32 bits nor sp.p can hold the prime, which matters when sqrt(hi) is above the last one below it)
+                unsigned long long p=b/5760*30030+conversions[b%5760];
+                if(p>sqrthi)
+                    break;
+                if(p<=presieved)
+                    continue;
+                SievePrime sp;
+                sp.p=p;
+                startSievePrime(sp,lo);
+                // near the top of a narrow range, most of them don't have a multiple in it at all
+                if(sp.s>hi)
+                    continue;
+                if(p>bucketbound)
+                    addToBucket(buckets,sp);
+                else
+                    primes.push_back(sp);
             }
-            if(exp){
-                factors[0]=2;
-                exponents[0]=exp;
-                numfacs=1;
-                exp=0;
+        }
+        // Sieves [lo, hi) of the stored sieve one segment at a time, with primes and buckets from basePrimes(lo,hi,...).
+        void sieveStored(unsigned long long lo, unsigned long long hi, std::vector<SievePrime>& primes, SieveBuckets& buckets){
+            ZMATH_TIME(CrossOffNanos);
+            while(lo<hi){
+                unsigned long long seghi=std::min(hi,lo+segmentblocks*30030ULL);
+                presieve(sieve,0,lo,seghi);
+                for(unsigned int i=0; i<primes.size(); ++i)
+                    crossOff(sieve,0,seghi,primes[i]);
+                crossOffBucket(buckets,sieve,0,seghi);
+                lo=seghi;
             }
-            while(!(n%3)){
-                ++exp;
-                n/=3;
+        }
+
+        // Calls f on the number for every set bit in [first, last) of bits, where bit b is the number
+        // (b+offset)/5760*30030+conversions[(b+offset)%5760], and offset is a multiple of 5760.
+        // Each word is a fixed piece of one wheel period, so the period is only worked out once per word.
+        template<class F> void decodeWords(const WheelBitset& bits, unsigned long long offset, unsigned long long first, unsigned long long last, F& f){
+            if(first>=last)
+                return;
+            ZMATH_TIME(DecodeNanos);
+            const unsigned long long* words=bits.data();
+            for(unsigned long long i=first>>6; i<=(last-1)>>6; ++i){
+                unsigned long long w=words[i];
+                if(i==first>>6)
+                    w&=~0ULL<<(first&63);
+                if(i==(last-1)>>6 && (last&63))
+                    w&=(1ULL<<(last&63))-1;
+                unsigned long long base=(offset/5760+i/90)*30030;
+                const unsigned short* conv=conversions+i%90*64;
+                while(w){
+                    f(base+conv[__builtin_ctzll(w)]);
+                    w&=w-1;
+                }
             }
-            if(exp){
-                factors[numfacs]=3;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
+        }
+
+        // Counts primes in (lo, hi] without storing them, one segment-sized window at a time.
+        // lo must be a multiple of 30030, and the sieve must already reach sqrt(hi).
+        unsigned long long countWindows(unsigned long long lo, unsigned long long hi){
+            std::vector<SievePrime> primes;
+            SieveBuckets buckets;
+            basePrimes(lo,hi,primes,buckets);
+            WheelBitset window;
+            unsigned long long t=0;
+            while(lo<hi){
+                unsigned long long winhi=std::min(hi+1,lo+segmentblocks*30030ULL);
+                if(winhi%30030)
+                    winhi+=30030-winhi%30030;
+                unsigned long long offset=lo/30030*5760;
+                window.assign((winhi-lo)/30030*5760);
+                {
+                    ZMATH_TIME(CrossOffNanos);
+                    presieve(window,offset,lo,winhi);
+                    for(unsigned int i=0; i<primes.size(); ++i)
+                        crossOff(window,offset,winhi,primes[i]);
+                    crossOffBucket(buckets,window,offset,winhi);
+                }
+                unsigned long long maxb=std::min(winhi,hi+1);
+                maxb=maxb/30030*5760+indexes[maxb%30030]-offset;
+                ZMATH_TIME(DecodeNanos);
+                t+=window.count(0,maxb);
+                lo=winhi;
             }
-            while(!(n%5)){
-                ++exp;
-                n/=5;
+            return t;
+        }
+        unsigned long long countParallel(unsigned long long lo, unsigned long long hi){
+            if(threads==1)
+                return countWindows(lo,hi);
+            std::atomic<unsigned long long> t(0);
+            forEachChunk(lo,hi,[&](unsigned long long a, unsigned long long b){
+                t+=countWindows(a,b);
+            });
+            return t;
+        }
+        // Counts the primes from lo to hi without growing the sieve. The part that's stored is counted out of it,
+        // and the rest in windows if the sieve reaches sqrt(hi), or one test at a time if it doesn't (or the range is narrow).
+        unsigned long long countRange(unsigned long long lo, unsigned long long hi){
+            const unsigned int firstsix[6]={2,3,5,7,11,13};
+            unsigned long long t=0;
+            for(unsigned int k=0; k<6; ++k){
+                if(firstsix[k]>=lo && firstsix[k]<=hi)
+                    ++t;
             }
-            if(exp){
-                factors[numfacs]=5;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
+            lo=std::max(lo,17ULL);
+            if(lo>hi)
+                return t;
+            if(lo<=maxstored){
+                t+=countStored(std::min(hi,maxstored))-(lo>17 ? countStored(lo-1) : 6);
+                if(hi<=maxstored)
+                    return t;
+                lo=maxstored+1;
+            }
+            // (the last wheel period below 2^64 can't be rounded up to, so it's left to the tests)
+            if(hi-lo>=isqrt(hi)/64 && isqrt(hi)+1<=maxstored && hi<~0ULL-~0ULL%30030){
+                unsigned long long start=lo-lo%30030;
+                t+=countParallel(start,hi);
+                if(start<lo)
+                    t-=countWindows(start,lo-1);
+                return t;
             }
-            while(!(n%7)){
-                ++exp;
-                n/=7;
+            for(unsigned long long b=lo/30030*5760+indexes[lo%30030]; ; ++b){
+                unsigned long long q=b/5760*30030+conversions[b%5760];
+                if(q>hi || q<lo)
+                    break;
+                if(q<289 || isProbablePrime(q))
+                    ++t;
             }
-            if(exp){
-                factors[numfacs]=7;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
+            return t;
+        }
+
+        // Calls f(p, i) for every prime p up to the square root of the end of [seg, seg+len), in increasing order,
+        // and every i where seg+i is a nonzero multiple of p. The sieve has to go up to that square root already.
+        template<class F> void forEachRangePrime(unsigned long long seg, unsigned long long len, F f){
+            unsigned long long sqrtend=isqrt(seg+(len-1));
+            const unsigned int firstsix[6]={2,3,5,7,11,13};
+            for(unsigned int k=0; k<6 && firstsix[k]<=sqrtend; ++k){
+                unsigned long long p=firstsix[k];
+                for(unsigned long long i=seg ? (p-seg%p)%p : p; i<len; i+=p)
+                    f(p,i);
+            }
+            for(unsigned long long b=sieve.next(1), p=17; p<=sqrtend; b=sieve.next(b+1), p=b/5760*30030+conversions[b%5760]){
+                for(unsigned long long i=seg ? (p-seg%p)%p : p; i<len; i+=p)
+                    f(p,i);
             }
-            while(!(n%11)){
-                ++exp;
-                n/=11;
+        }
+
+        // phi(n) is the number of integers from 1 to n that aren't divisible by 2, 3, 5, 7, 11, or 13.
+        unsigned long long phi(unsigned long long n){
+            return (n+1)/30030*5760+indexes[(n+1)%30030];
+        }
+        static unsigned long long isqrt(unsigned long long n){
+            // sqrt rounds up to 2^32 near the top, and squaring that overflows
+            unsigned long long r=std::min((unsigned long long)sqrt(n),4294967295ULL);
+            while(r*r>n)
+                --r;
+            while(r<4294967295ULL && (r+1)*(r+1)<=n)
+                ++r;
+            return r;
+        }
+        // The logarithmic integral, by Ramanujan's series
+        static double li(double x){
+            double logx=log(x);
+            double sum=0, term=1, inner=0;
+            for(unsigned int n=1; n<200; ++n){
+                term*=-logx/(n*2.0);
+                if(n%2)
+                    inner+=1.0/n;
+                double add=-term*inner*2;
+                sum+=add;
+                if(fabs(add)<1e-17*fabs(sum))
+                    break;
+            }
+            return 0.5772156649015329+log(logx)+sqrt(x)*sum;
+        }
+        // The x with li(x)=k, by Newton's method, since li'(x)=1/log(x)
+        static double inverseLi(double k){
+            double x=k*log(k)+2;
+            for(unsigned int i=0; i<100; ++i){
+                double step=(li(x)-k)*log(x);
+                x-=step;
+                if(fabs(step)<1)
+                    break;
+            }
+            return x;
+        }
+
+        // The ordinary leaves: the sum of mu(n)*phi(x/n) over squarefree n <= y with no prime factors below 17.
+        // mu is the sign of n, and primes[b] is the smallest prime n can be multiplied by.
+        long long ordinaryLeaves(unsigned long long x, unsigned long long y, const std::vector<unsigned int>& primes, unsigned int b, unsigned long long n, int mu){
+            long long t=0;
+            for(; b<primes.size() && n*primes[b]<=y; ++b){
+                unsigned long long m=n*primes[b];
+                t-=mu*(long long)phi(x/m);
+                t+=ordinaryLeaves(x,y,primes,b+1,m,-mu);
             }
-            if(exp){
-                factors[numfacs]=11;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
+            return t;
+        }
+
+        // Counts the primes up to x with the Lagarias-Miller-Odlyzko method.
+        // With y = alpha*x^(1/3) and a = pi(y), pi(x) = phi(x, a) + a - 1 - P2(x, a),
+        // where P2 counts the numbers up to x that are the product of two primes above y,
+        // and phi(x, a), the numbers up to x that aren't divisible by any of the first a primes,
+        // is split into the ordinary leaves, which the wheel tables answer directly,
+        // and the special leaves phi(x/(p_b*m), b-1), which are read off a sieve of [1, x/y]
+        // as it has each prime p_b crossed off in turn.
+        unsigned long long countLMO(unsigned long long x){
+            unsigned long long sqrtx=isqrt(x);
+            double alpha=std::max(1.0,log(x)*log(x)*log(x)/5000);
+            unsigned long long y=alpha*cbrt(x);
+            y=std::max(y,(unsigned long long)cbrt(x)+1);
+            y=std::min(std::max(y,17ULL),sqrtx-1);
+            // Past the memory limit, the primes up to sqrt(x) aren't there to walk, so it's counted the way numPrimesUpTo would without LMO
+            if(!growSieveTo(sqrtx))
+                return numPrimesUpTo(x);
+
+            // primes[b] is the bth prime, starting at primes[1]=2
+            std::vector<unsigned int> primes(1,0);
+            const unsigned int firstsix[6]={2,3,5,7,11,13};
+            primes.insert(primes.end(),firstsix,firstsix+6);
+            for(unsigned long long b=sieve.next(1); b/5760*30030+conversions[b%5760]<=y; b=sieve.next(b+1))
+                primes.push_back(b/5760*30030+conversions[b%5760]);
+            unsigned long long a=primes.size()-1;
+
+            // lpfmu[m] is the least prime factor of m, negated if mu(m)=-1, or 0 if m isn't squarefree
+            std::vector<int> lpfmu(y+1,1);
+            for(unsigned int b=1; b<=a; ++b){
+                unsigned long long p=primes[b];
+                for(unsigned long long m=p; m<=y; m+=p){
+                    if(lpfmu[m]==1 || lpfmu[m]==-1)
+                        lpfmu[m]=lpfmu[m]>0 ? -(int)p : (int)p;
+                    else
+                        lpfmu[m]=-lpfmu[m];
+                }
+                for(unsigned long long m=p*p; m<=y; m+=p*p)
+                    lpfmu[m]=0;
             }
-            while(!(n%13)){
-                ++exp;
-                n/=13;
+
+            std::vector<unsigned int> bigprimes(primes.begin()+7,primes.end());
+            long long s1=phi(x)+ordinaryLeaves(x,y,bigprimes,0,1,1);
+
+            // When p_b > sqrt(y), m has to be a prime q above p_b. If x/(p_b*q) <= y, it's below p_b^2 as well,
+            // so everything up to it that survives the first b-1 primes is 1 or a prime,
+            // and phi(x/(p_b*q), b-1) = 1 + max(0, pi(x/(p_b*q)) - (b-1)) without any sieving.
+            long long s2=0;
+            {
+                std::vector<unsigned int> pi(y+1,0);
+                for(unsigned int b=1; b<=a; ++b)
+                    pi[primes[b]]=1;
+                for(unsigned long long i=1; i<=y; ++i)
+                    pi[i]+=pi[i-1];
+                for(unsigned int b=7; b<a; ++b){
+                    unsigned long long p=primes[b];
+                    if(p*p<=y)
+                        continue;
+                    // The primes q are taken from the top down. Above sqrt(x/p_b), x/(p_b*q) moves slower than the primes do,
+                    // so they're taken a run at a time, where every q in the run gives the same pi(x/(p_b*q)).
+                    unsigned long long xp=x/p;
+                    unsigned long long last=std::max((unsigned long long)b,(unsigned long long)pi[std::min(y,xp/(y+1))]);
+                    for(unsigned long long i=a; i>last; ){
+                        unsigned long long q=primes[i];
+                        unsigned long long k=pi[xp/q];
+                        unsigned long long j=i-1;
+                        if(q*q>xp && k<a)
+                            j=std::max(last,(unsigned long long)pi[std::min(y,xp/primes[k+1])]);
+                        s2+=(i-j)*(k>=b ? k-b+2 : 1);
+                        i=j;
+                    }
+                }
             }
-            if(exp){
-                factors[numfacs]=13;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
-            }
-            unsigned int b = 1;
-            unsigned int p = 17;
-            if(maxsieve*maxsieve<n){
-                while(b<maxbool && p*p<=n){
-                    while(!(n%p)){
-                        ++exp;
-                        n/=p;
+
+            // Sieve [0, x/y] in segments of whole wheel periods, with a counter for every 1024 bits
+            // so the number of bits left before any point in the segment takes at most 16 popcounts.
+            unsigned long long limit=x/y;
+            unsigned long long seglen=std::max(isqrt(limit),segmentblocks*30030ULL);
+            seglen+=(30030-seglen%30030)%30030;
+            std::vector<SievePrime> crossing(a+1);
+            for(unsigned int b=7; b<=a; ++b){
+                crossing[b].p=primes[b];
+                crossing[b].s=primes[b];
+                crossing[b].w=0;
+            }
+            std::vector<unsigned long long> phib(a+1,0);
+            std::vector<unsigned int> counters;
+            WheelBitset window;
+            for(unsigned long long lo=0; lo<=limit; lo+=seglen){
+                unsigned long long hi=lo+seglen;
+                unsigned long long offset=lo/30030*5760;
+                unsigned long long numbits=seglen/30030*5760;
+                window.assign(numbits);
+                counters.assign((numbits+1023)/1024,1024);
+                if(numbits%1024)
+                    counters.back()=numbits%1024;
+                unsigned long long total=numbits;
+                for(unsigned int b=7; b<=a; ++b){
+                    unsigned long long p=primes[b];
+                    unsigned long long xp=x/p;
+                    // The leaves for p_b are phi(x/(p_b*m), b-1) for squarefree m in (y/p_b, y] with no prime factors up to p_b,
+                    // taken in order of increasing x/(p_b*m), so the count of bits can sweep forward through the segment.
+                    unsigned long long chunk=0;
+                    unsigned long long before=0;
+                    if(p*p<=y){
+                        unsigned long long mmax=std::min(y,lo ? xp/lo : y);
+                        unsigned long long mmin=std::max(y/p,xp/hi);
+                        for(unsigned long long m=mmax; m>mmin; --m){
+                            int lm=lpfmu[m];
+                            if(lm==0 || (unsigned int)(lm>0 ? lm : -lm)<=p)
+                                continue;
+                            unsigned long long u=xp/m;
+                            unsigned long long bit=(u+1)/30030*5760+indexes[(u+1)%30030]-offset;
+                            while((chunk+1)*1024<=bit)
+                                before+=counters[chunk++];
+                            long long count=phib[b]+before+window.count(chunk*1024,bit);
+                            s2+=lm>0 ? -count : count;
+                        }
+                    }else{
+                        // The leaves left are the ones above y. Once x/(p_b*p_(b+1)) is below the segment or y,
+                        // so is every leaf of every later prime.
+                        if(b==a || xp/primes[b+1]<std::max(lo,y+1))
+                            break;
+                        unsigned long long qmax=std::min(std::min(y,xp/(y+1)),lo ? xp/lo : y);
+                        unsigned long long qmin=std::max(p,xp/hi);
+                        unsigned long long i=std::upper_bound(primes.begin()+b+1,primes.end(),qmax)-primes.begin();
+                        for(--i; primes[i]>qmin; --i){
+                            unsigned long long u=xp/primes[i];
+                            unsigned long long bit=(u+1)/30030*5760+indexes[(u+1)%30030]-offset;
+                            while((chunk+1)*1024<=bit)
+                                before+=counters[chunk++];
+                            s2+=phib[b]+before+window.count(chunk*1024,bit);
+                        }
                     }
-                    if(exp){
-                        factors[numfacs]=p;
-                        exponents[numfacs]=exp;
-                        ++numfacs;
-                        exp=0;
+                    phib[b]+=total;
+                    // then cross off p_b, keeping the counters up to date
+                    SievePrime& sp=crossing[b];
+                    unsigned long long s=sp.s;
+                    unsigned short w=sp.w;
+                    while(s<hi){
+                        unsigned long long bit=s/30030*5760+indexes[s%30030]-offset;
+                        if(window[bit]){
+                            window.reset(bit);
+                            --counters[bit>>10];
+                            --total;
+                        }
+                        s+=p*wheel[w];
+                        ++w;
+                        if(w==5760)
+                            w=0;
                     }
-                    ++b;
-                    while(!sieve[b])
-                        ++b;
-                    p = b/5760*30030+conversions[b%5760];
+                    sp.s=s;
+                    sp.w=w;
                 }
-                if(p*p<=n)
-                    doSieve(sqrt(n));
-            }
-            if(p*p<=n){
-                while(!sieve[b])
-                    ++b;
-                p = b/5760*30030+conversions[b%5760];
-            }
-            while(p*p<=n){
-                while(!(n%p)){
-                    ++exp;
-                    n/=p;
+            }
+
+            // P2 is the sum of pi(x/p)-pi(p)+1 over primes y < p <= sqrt(x). Taking p from the top down,
+            // x/p goes up from sqrt(x) to x/y, so pi(x/p) comes from one pass of windows over that range.
+            long long p2=0;
+            unsigned long long pb=sieve.prev(phi(sqrtx)-1);
+            unsigned long long p=pb/5760*30030+conversions[pb%5760];
+            if(p>y){
+                unsigned long long pip=numPrimesUpTo(p);
+                unsigned long long lo=sqrtx-sqrtx%30030;
+                unsigned long long pilo=lo ? numPrimesUpTo(lo) : 6;
+                std::vector<SievePrime> base;
+                SieveBuckets buckets;
+                basePrimes(lo,limit,base,buckets);
+                while(p>y){
+                    unsigned long long hi=lo+segmentblocks*30030ULL;
+                    unsigned long long offset=lo/30030*5760;
+                    window.assign(segmentblocks*5760);
+                    presieve(window,offset,lo,hi);
+                    for(unsigned int i=0; i<base.size(); ++i)
+                        crossOff(window,offset,hi,base[i]);
+                    crossOffBucket(buckets,window,offset,hi);
+                    unsigned long long bit=0;
+                    unsigned long long count=pilo;
+                    while(p>y && x/p<hi){
+                        unsigned long long u=x/p;
+                        unsigned long long ubit=(u+1)/30030*5760+indexes[(u+1)%30030]-offset;
+                        count+=window.count(bit,ubit);
+                        bit=ubit;
+                        p2+=count-pip+1;
+                        --pip;
+                        pb=sieve.prev(pb-1);
+                        p=pb/5760*30030+conversions[pb%5760];
+                    }
+                    pilo+=window.count(0,segmentblocks*5760);
+                    lo=hi;
                 }
-                if(exp){
-                    factors[numfacs]=p;
-                    exponents[numfacs]=exp;
-                    ++numfacs;
-                    exp=0;
+            }
+            return s1+s2+a-1-p2;
+        }
+
+        // Splits [lo, hi) into chunks of whole segments, starting at multiples of 30030,
+        // and hands them out to the worker threads until they run out.
+        template<class F> void forEachChunk(unsigned long long lo, unsigned long long hi, F f){
+            unsigned long long seg=segmentblocks*30030ULL;
+            unsigned long long chunk=(hi-lo)/(threads*8ULL);
+            chunk=std::max(seg,chunk-chunk%seg);
+            unsigned long long numchunks=(hi-lo+chunk-1)/chunk;
+            std::atomic<unsigned long long> next(0);
+            auto work=[&](){
+                for(unsigned long long c=next++; c<numchunks; c=next++)
+                    f(lo+c*chunk,std::min(hi,lo+(c+1)*chunk));
+            };
+            std::vector<std::thread> pool;
+            for(unsigned long long i=1; i<threads && i<numchunks; ++i)
+                pool.push_back(std::thread(work));
+            work();
+            for(unsigned int i=0; i<pool.size(); ++i)
+                pool[i].join();
+        }
+        // The part of a snapshot header that says what wrote it, with the limits left at 0
+        void fillHeader(SnapshotHeader& header){
+            memset(&header,0,sizeof(header));
+            memcpy(header.magic,"ZMATHSV",8);
+            header.version=snapshotversion;
+            header.headersize=sizeof(header);
+            header.byteorder=0x0102030405060708ULL;
+        }
+        // Checks the snapshot in fd against this build, and maps it in as the sieve if it's good and goes further than this one
+        bool attachSnapshot(int fd){
+            struct stat st;
+            if(fstat(fd,&st) || (unsigned long long)st.st_size<snapshotoffset)
+                return false;
+            SnapshotHeader header, expected;
+            fillHeader(expected);
+            if(pread(fd,&header,sizeof(header),0)!=(ssize_t)sizeof(header) || memcmp(&header,&expected,offsetof(SnapshotHeader,maxsieve)))
+                return false;
+            // the limits have to be ones doSieve and doBigSieve could have left, and the sieve has to be the size they'd make it
+            if(header.maxsieve%30030 || header.maxsieve>4289995710U || header.maxbigsieve%30030 || header.maxbigsieve<4289995710U
+                || (header.maxbigsieve>4289995710U && header.maxsieve<4289995710U))
+                return false;
+            unsigned long long top=header.maxsieve<4289995710U ? header.maxsieve : header.maxbigsieve;
+            if(header.numwords!=(top/1001*192+64)/64 || (unsigned long long)st.st_size<snapshotoffset+header.numwords*8)
+                return false;
+            if(top<=maxstored)
+                return false;
+            // and it has to have been made with the same wheel
+            std::vector<char> tables(sizeof(WheelTables));
+            if(pread(fd,&tables[0],tables.size(),sizeof(header))!=(ssize_t)tables.size()
+                || memcmp(&tables[0],&SharedWheelTables<>::tables,sizeof(WheelTables)))
+                return false;
+            if(!sieve.map(fd,snapshotoffset,header.numwords))
+                return false;
+            maxsieve=header.maxsieve;
+            maxbool=maxsieve/1001*192;
+            maxbigsieve=header.maxbigsieve;
+            maxbigbool=maxbigsieve>4289995710U ? maxbigsieve/1001*192 : 0;
+            maxstored=top;
+            restartSievePrimes(top);
+            ranks.clear();
+            updateRanks();
+            return true;
+        }
+        // Leaves the base primes where sieveSegments would have if it had just sieved up to hi, so the next extension can pick up from there.
+        void restartSievePrimes(unsigned long long hi){
+            ZMATH_TIME(BasePrimeNanos);
+            sieveprimes.clear();
+            sievebase=1;
+            while(true){
+                sievebase=sieve.next(sievebase);
+                SievePrime sp;
+                sp.p=sievebase/5760*30030+conversions[sievebase%5760];
+                if((unsigned long long)sp.p*sp.p>=hi)
+                    break;
+                if(sp.p>presieved){
+                    startSievePrime(sp,hi);
+                    sieveprimes.push_back(sp);
                 }
-                ++b;
-                while(!sieve[b])
-                    ++b;
-                p = b/5760*30030+conversions[b%5760];
+                ++sievebase;
             }
-            if(n>1){
-                factors[numfacs]=n;
-                exponents[numfacs]=1;
-                ++numfacs;
+        }
+        // Sieves [lo, hi), splitting it across the worker threads if there are any.
+        // Chunks start and end on multiples of 30030, which are whole words of the sieve,
+        // so no two threads ever write to the same word.
+        void extendSieve(unsigned long long lo, unsigned long long hi){
+            unsigned long long mid=sqrt(hi)+1;
+            if(mid%30030)
+                mid+=30030-mid%30030;
+            if(threads==1 || hi<=std::max(lo,mid)+2*segmentblocks*30030ULL){
+                sieveSegments(lo,hi);
+                return;
             }
-            return numfacs;
+            // the base primes have to be finished before any chunk can use them
+            if(mid>lo){
+                sieveSegments(lo,mid);
+                lo=mid;
+            }
+            forEachChunk(lo,hi,[&](unsigned long long a, unsigned long long b){
+                std::vector<SievePrime> primes;
+                SieveBuckets buckets;
+                basePrimes(a,b,primes,buckets);
+                sieveStored(a,b,primes,buckets);
+            });
+            restartSievePrimes(hi);
         }
-        unsigned char factorSmallUnsafe(unsigned int n, unsigned int* factors, unsigned char* exponents){
-            unsigned char exp=0;
-            unsigned char numfacs=0;
-            while(!(n&1U)){
-                ++exp;
-                n>>=1;
+
+        // For each 512-bit cache line of the sieve, base is the number of set bits before it,
+        // and prefix packs the number of set bits before each of its last 7 words into 9 bits each.
+        struct RankLine {
+            unsigned long long base;
+            unsigned long long prefix;
+        };
+        bool ranked = false;
+        std::vector<RankLine> ranks;
+
+        unsigned long long memorylimit = 0;
+        // Atomic, since ConcurrentPrimeData runs queries on one PrimeData from many threads
+        struct StrategyRecord {
+            std::atomic<int> value;
+
+            StrategyRecord() : value(StoredSieve) {}
+            StrategyRecord(const StrategyRecord& other) : value(other.value.load(std::memory_order_relaxed)) {}
+            StrategyRecord& operator=(const StrategyRecord& other){
+                value.store(other.value.load(std::memory_order_relaxed),std::memory_order_relaxed);
+                return *this;
+            }
+        };
+        StrategyRecord strategy;
+
+        void setStrategy(Strategy s){
+            strategy.value.store(s,std::memory_order_relaxed);
+        }
+        // The memory the sieve takes up to n, 720 bytes per wheel period, plus 16 bytes per 64 for the rank index if there is one
+        unsigned long long storedBytes(unsigned long long n) const {
+            unsigned long long bytes=(n/30030+1)*720;
+            return ranked ? bytes+bytes/4 : bytes;
+        }
+        bool fits(unsigned long long n) const {
+            return !memorylimit || storedBytes(n)<=memorylimit;
+        }
+        // The furthest the sieve can go within the memory limit
+        unsigned long long largestFit() const {
+            if(!memorylimit)
+                return ~0ULL-1;
+            unsigned long long periods=(ranked ? memorylimit/5*4 : memorylimit)/720;
+            if(periods<2)
+                return 0;
+            return std::min(periods-1,(~0ULL-1)/30030)*30030;
+        }
+        // What the memory limit leaves over after the sieve
+        unsigned long long roomLeft() const {
+            unsigned long long held=storedBytes(maxstored);
+            return memorylimit>held ? memorylimit-held : 0;
+        }
+        // Lowers hi, if it has to, so that the primes from lo to hi fit in what's left of the memory limit at size bytes each.
+        // If not even one of them fits, hi goes below lo (or to 1). Returns false if it lowered hi.
+        // It never grows the sieve, since ConcurrentPrimeData calls it on a PrimeData that other threads are reading.
+        bool fitOutput(unsigned long long lo, unsigned long long& hi, double size){
+            if(!memorylimit || hi<17 || lo>hi)
+                return true;
+            double room=roomLeft();
+            // There are at most 1.25506*n/log(n) primes up to n, and vectors reserve a little over pi(n).
+            // Past lo, they're no denser than about 1/log(lo), so a range far above 0 goes by its width instead.
+            double most=1.25506*hi/log((double)hi);
+            if(lo>=17)
+                most=std::min(most,1.25506*(hi-lo+1)/log((double)lo));
+            if(most*size<=room)
+                return true;
+            unsigned long long left=room*0.98/size;
+            if(!left){
+                hi=lo>1 ? lo-1 : 1;
+                return false;
             }
-            if(exp){
-                factors[0]=2;
-                exponents[0]=exp;
-                numfacs=1;
-                exp=0;
+            // Count forward from lo to the last prime that fits. Each window is sized to hold about as many primes as are left,
+            // and halved whenever it holds too many.
+            unsigned long long a=lo;
+            unsigned long long w=fitWindow(a,left);
+            while(left){
+                unsigned long long b=hi-a<w ? hi : a+w-1;
+                unsigned long long c=countRange(a,b);
+                if(c<=left){
+                    if(b==hi)
+                        return true;
+                    left-=c;
+                    a=b+1;
+                    w=fitWindow(a,left);
+                }else if(w>1)
+                    w/=2;
+                else
+                    break;
+            }
+            hi=a ? a-1 : 0;
+            return false;
+        }
+        // About how many numbers from a on hold k primes
+        static unsigned long long fitWindow(unsigned long long a, unsigned long long k){
+            double x=std::max((double)a,17.0);
+            double w=k*log(x+k*log(x));
+            return w<1 ? 1 : w>=18446744073709549568.0 ? ~0ULL : (unsigned long long)w;
+        }
+        // How far firstPrimes has to go to find n primes. The nth prime is below n*(log(n)+log(log(n))) once n is at least 6.
+        static unsigned long long firstPrimesBound(unsigned long long n){
+            return n<6 ? 13 : n*log(n*log(n));
+        }
+        // How many of n primes fit in what's left of the memory limit at size bytes each
+        unsigned long long fitCount(unsigned long long n, double size){
+            if(!memorylimit)
+                return n;
+            return std::min(n,(unsigned long long)(roomLeft()/size));
+        }
+
+#ifdef ZMATH_STATS
+        // Atomic, because ConcurrentPrimeData queries one PrimeData from many threads, and the sieve is crossed off on several.
+        // Copying a PrimeData copies its counts.
+        struct StatCounters {
+            std::atomic<unsigned long long> counts[NumPrimeStats];
+            bool hardware = false;
+
+            StatCounters(){
+                reset();
+            }
+            StatCounters(const StatCounters& other){
+                *this=other;
+            }
+            StatCounters& operator=(const StatCounters& other){
+                for(unsigned int i=0; i<NumPrimeStats; ++i)
+                    counts[i].store(other.counts[i].load(std::memory_order_relaxed),std::memory_order_relaxed);
+                hardware=other.hardware;
+                return *this;
+            }
+            void reset(){
+                for(unsigned int i=0; i<NumPrimeStats; ++i)
+                    counts[i].store(0,std::memory_order_relaxed);
+            }
+            void add(PrimeStat s, unsigned long long n){
+                counts[s].fetch_add(n,std::memory_order_relaxed);
+            }
+        };
+        // Adds the time from when it's made to when it goes out of scope to one phase, along with the hardware counts
+        class PhaseTimer {
+            public:
+                PhaseTimer(StatCounters& counters, PrimeStat phase) : counters(counters), phase(phase) {
+#ifdef __linux__
+                    if(counters.hardware)
+                        HardwareCounters::thisThread().read(misses);
+#endif
+                    start=std::chrono::steady_clock::now();
+                }
+                ~PhaseTimer(){
+                    counters.add(phase,std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-start).count());
+#ifdef __linux__
+                    if(counters.hardware){
+                        unsigned long long now[2];
+                        HardwareCounters::thisThread().read(now);
+                        counters.add(CacheMisses,now[0]-misses[0]);
+                        counters.add(BranchMisses,now[1]-misses[1]);
+                    }
+#endif
+                }
+
+            private:
+                StatCounters& counters;
+                PrimeStat phase;
+                std::chrono::steady_clock::time_point start;
+                unsigned long long misses[2];
+        };
+        StatCounters statcounters;
+#endif
+
+        // Brings the rank index up to the end of the sieve.
+        // Only the last line that was indexed and the lines after it can have changed since last time.
+        void updateRanks(){
+            if(!ranked)
+                return;
+            unsigned long long end=maxstored/30030*5760;
+            unsigned long long line=ranks.empty() ? 0 : ranks.size()-1;
+            unsigned long long numwords=sieve.size()/64;
+            const unsigned long long* words=sieve.data();
+            ranks.resize(end/512+1);
+            unsigned long long t=line ? ranks[line].base : 0;
+            for(; line<ranks.size(); ++line){
+                ranks[line].base=t;
+                ranks[line].prefix=0;
+                for(unsigned int i=0; i<8 && line*8+i<numwords; ++i){
+                    if(i)
+                        ranks[line].prefix|=(t-ranks[line].base)<<(9*(i-1));
+                    t+=__builtin_popcountll(words[line*8+i]);
+                }
             }
-            while(!(n%3)){
-                ++exp;
-                n/=3;
+        }
+        // Returns the number of set bits before bit b, for b up to the end of the sieve.
+        unsigned long long rank(unsigned long long b){
+            const RankLine& r=ranks[b>>9];
+            unsigned int i=(b>>6)&7;
+            unsigned long long t=r.base;
+            if(i)
+                t+=(r.prefix>>(9*(i-1)))&511;
+            if(b&63)
+                t+=__builtin_popcountll(sieve.data()[b>>6]&((1ULL<<(b&63))-1));
+            return t;
+        }
+
+        // Montgomery multiplication mod an odd n: a*b/2^64 mod n, where ninv is n^-1 mod 2^64
+        static unsigned long long montMul(unsigned long long a, unsigned long long b, unsigned long long n, unsigned long long ninv){
+            unsigned __int128 t=(unsigned __int128)a*b;
+            unsigned long long hi=t>>64;
+            unsigned long long m=(unsigned long long)t*ninv;
+            unsigned long long mn=((unsigned __int128)m*n)>>64;
+            return hi-mn+(n&(0-(unsigned long long)(hi<mn)));
+        }
+
+        // a+b mod n, for a and b below n
+        static unsigned long long addMod(unsigned long long a, unsigned long long b, unsigned long long n){
+            return a>=n-b ? a-(n-b) : a+b;
+        }
+        // a*2^64 mod n, for a small a, given one = 2^64 mod n. Doubling and adding takes the place of a 128-bit division.
+        static unsigned long long toMontgomery(unsigned long long a, unsigned long long one, unsigned long long n){
+            unsigned long long x=one;
+            for(unsigned int j=62-__builtin_clzll(a); j<64; --j){
+                x=addMod(x,x,n);
+                if(a>>j&1)
+                    x=addMod(x,one,n);
+            }
+            return x;
+        }
+
+        // Checks that n is a strong probable prime to each of the k bases, which have to be below n. The k powers are taken side by side,
+        // since each one is a chain of multiplications that can't start until the last one is done.
+        // Everything is kept multiplied by 2^64 mod n, which is one, and ninv is n^-1 mod 2^64.
+        template<unsigned int k> static bool strongProbablePrime(unsigned long long n, unsigned long long ninv, unsigned long long one, const unsigned long long* bases){
+            unsigned long long minusone=n-one;
+            unsigned long long d=n-1;
+            unsigned int s=__builtin_ctzll(d);
+            d>>=s;
+            unsigned long long a[k], x[k];
+            for(unsigned int i=0; i<k; ++i){
+                a[i]=toMontgomery(bases[i],one,n);
+                x[i]=a[i];
+            }
+            for(unsigned int j=62-__builtin_clzll(d); j<64; --j){
+                for(unsigned int i=0; i<k; ++i)
+                    x[i]=montMul(x[i],x[i],n,ninv);
+                if(d>>j&1)
+                    for(unsigned int i=0; i<k; ++i)
+                        x[i]=montMul(x[i],a[i],n,ninv);
+            }
+            for(unsigned int i=0; i<k; ++i){
+                if(x[i]==one || x[i]==minusone)
+                    continue;
+                unsigned int j=1;
+                for(; j<s; ++j){
+                    x[i]=montMul(x[i],x[i],n,ninv);
+                    if(x[i]==minusone)
+                        break;
+                }
+                if(j>=s)
+                    return false;
             }
-            if(exp){
-                factors[numfacs]=3;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
+            return true;
+        }
+
+        static int jacobi(unsigned long long a, unsigned long long n){
+            int t=1;
+            a%=n;
+            while(a){
+                while(!(a&1)){
+                    a>>=1;
+                    if((n&7)==3 || (n&7)==5)
+                        t=-t;
+                }
+                std::swap(a,n);
+                if((a&3)==3 && (n&3)==3)
+                    t=-t;
+                a%=n;
             }
-            while(!(n%5)){
-                ++exp;
-                n/=5;
+            return n==1 ? t : 0;
+        }
+
+        // The Baillie-PSW test: a strong probable prime test to base 2, and the extra strong Lucas test
+        // with Q=1 and the first P=3, 4, 5, ... where P^2-4 isn't a square mod n. Only the Lucas V sequence is needed,
+        // since U_d=0 exactly when 2*V_(d+1) = P*V_d. The two chains of multiplications are run side by side, like the bases above,
+        // so a prime takes about as long as either one.
+        static bool baillieProbablePrime(unsigned long long n, unsigned long long ninv, unsigned long long one){
+            unsigned long long P=3;
+            for(int j=jacobi(P*P-4,n); j!=-1; j=jacobi(P*P-4,n)){
+                if(!j)
+                    return false;
+                ++P;
+                // a square never finds one, and anything else almost always has by now
+                if(P==20){
+                    unsigned long long r=isqrt(n);
+                    if(r*r==n)
+                        return false;
+                }
             }
-            if(exp){
-                factors[numfacs]=5;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
+            unsigned long long minusone=n-one;
+            unsigned long long two=addMod(one,one,n);
+            unsigned long long p=toMontgomery(P,one,n);
+            unsigned long long d=n-1;
+            unsigned int s=__builtin_ctzll(d);
+            d>>=s;
+            unsigned long long e=n+1;
+            unsigned int t=__builtin_ctzll(e);
+            e>>=t;
+            // x is 2^k, for k through the leading bits of d, and v is V_k and w is V_(k+1), for k through the leading bits of e
+            unsigned long long x=two, v=two, w=p;
+            unsigned int topd=62-__builtin_clzll(d), tope=63-__builtin_clzll(e);
+            // The bits pick values with masks instead of branches, which would be mispredicted half the time and stall both chains
+            for(unsigned int j=std::max(topd+1,tope); j<64; --j){
+                if(j<=topd){
+                    x=montMul(x,x,n,ninv);
+                    // multiplying by the base is just doubling
+                    x=addMod(x,x&(0-(d>>j&1)),n);
+                }
+                if(j<=tope){
+                    unsigned long long bit=0-(e>>j&1);
+                    unsigned long long vw=montMul(v,w,n,ninv);
+                    vw=vw>=p ? vw-p : vw-p+n;
+                    // V_2k=V_k^2-2, and V_(2k+1)=V_k*V_(k+1)-P
+                    unsigned long long sq=(w&bit)|(v&~bit);
+                    sq=montMul(sq,sq,n,ninv);
+                    sq=sq>=two ? sq-two : sq-two+n;
+                    v=(vw&bit)|(sq&~bit);
+                    w=(sq&bit)|(vw&~bit);
+                }
             }
-            while(!(n%7)){
-                ++exp;
-                n/=7;
+            if(x!=one && x!=minusone){
+                unsigned int j=1;
+                for(; j<s; ++j){
+                    x=montMul(x,x,n,ninv);
+                    if(x==minusone)
+                        break;
+                }
+                if(j>=s)
+                    return false;
             }
-            if(exp){
-                factors[numfacs]=7;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
+            if(v==two || v==n-two){
+                unsigned long long w2=addMod(w,w,n);
+                if(w2==montMul(p,v,n,ninv))
+                    return true;
             }
-            while(!(n%11)){
-                ++exp;
-                n/=11;
+            for(unsigned int j=1; j<t; ++j){
+                if(!v)
+                    return true;
+                v=montMul(v,v,n,ninv);
+                v=v>=two ? v-two : v-two+n;
             }
-            if(exp){
-                factors[numfacs]=11;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
+            return false;
+        }
+
+        // For an odd n above 13^2 that isn't divisible by 3, 5, 7, 11, or 13.
+        // Below 4759123141 the bases 2, 7, 61 are enough. Above that, it's the Baillie-PSW test,
+        // which has no pseudoprimes below 2^64: every strong pseudoprime to base 2 up there is known, and none pass the Lucas test.
+        static bool isProbablePrime(unsigned long long n){
+            static const unsigned long long bases[3]={2,7,61};
+            unsigned long long ninv=n;
+            for(unsigned int i=0; i<5; ++i)
+                ninv*=2-n*ninv;
+            unsigned long long one=(0-n)%n;
+            if(n<4759123141ULL)
+                return strongProbablePrime<3>(n,ninv,one,bases);
+            return baillieProbablePrime(n,ninv,one);
+        }
+
+        static unsigned long long gcd(unsigned long long a, unsigned long long b){
+            if(!a || !b)
+                return a|b;
+            unsigned int shift=__builtin_ctzll(a|b);
+            a>>=__builtin_ctzll(a);
+            while(b){
+                b>>=__builtin_ctzll(b);
+                if(a>b)
+                    std::swap(a,b);
+                b-=a;
+            }
+            return a<<shift;
+        }
+
+        // Pollard's rho with Brent's cycle detection, on x -> x^2+c in Montgomery form, for c, c+1, c+2, and c+3 side by side.
+        // Each step has to wait for the last one, so running four walks at once costs little more than one,
+        // and whichever one finds a factor first ends it. The differences are multiplied together 128 at a time,
+        // so it only takes one gcd per 128 steps. Returns 0 if it goes more than 2^maxlog steps without finding anything.
+        static unsigned long long pollardBrent(unsigned long long n, unsigned long long c, unsigned int maxlog){
+            unsigned long long ninv=n;
+            for(unsigned int i=0; i<5; ++i)
+                ninv*=2-n*ninv;
+            unsigned long long x[4], y[4], ys[4], q[4], cs[4];
+            for(unsigned int l=0; l<4; ++l){
+                cs[l]=c+l;
+                x[l]=y[l]=ys[l]=cs[l];
+                q[l]=(0-n)%n;
+            }
+            unsigned long long g=1;
+            for(unsigned long long r=1; g==1; r*=2){
+                if(r>>maxlog)
+                    return 0;
+                for(unsigned int l=0; l<4; ++l)
+                    x[l]=y[l];
+                for(unsigned long long i=0; i<r; ++i){
+                    for(unsigned int l=0; l<4; ++l){
+                        y[l]=montMul(y[l],y[l],n,ninv)+cs[l];
+                        y[l]=y[l]>=n ? y[l]-n : y[l];
+                    }
+                }
+                for(unsigned long long k=0; k<r && g==1; k+=128){
+                    for(unsigned int l=0; l<4; ++l)
+                        ys[l]=y[l];
+                    for(unsigned long long i=0; i<128 && i<r-k; ++i){
+                        for(unsigned int l=0; l<4; ++l){
+                            y[l]=montMul(y[l],y[l],n,ninv)+cs[l];
+                            y[l]=y[l]>=n ? y[l]-n : y[l];
+                            q[l]=montMul(q[l],x[l]>y[l] ? x[l]-y[l] : y[l]-x[l],n,ninv);
+                        }
+                    }
+                    g=gcd(montMul(montMul(q[0],q[1],n,ninv),montMul(q[2],q[3],n,ninv),n,ninv),n);
+                }
             }
-            while(!(n%13)){
-                ++exp;
-                n/=13;
+            if(g!=n)
+                return g;
+            // The batch overshot into a multiple of n, so go back to the start of it one step at a time, in each walk that hit something
+            for(unsigned int l=0; l<4; ++l){
+                if(gcd(q[l],n)==1)
+                    continue;
+                do{
+                    ys[l]=montMul(ys[l],ys[l],n,ninv)+cs[l];
+                    ys[l]=ys[l]>=n ? ys[l]-n : ys[l];
+                    g=gcd(x[l]>ys[l] ? x[l]-ys[l] : ys[l]-x[l],n);
+                }while(g==1);
+                if(g!=n)
+                    return g;
+            }
+            return 0;
+        }
+
+        // Shanks' square forms factorization, trying the multipliers k in turn while k*n still fits in 64 bits.
+        // Returns 0 if none of them work.
+        static unsigned long long squfof(unsigned long long n){
+            static const unsigned int multipliers[16]={1,3,5,7,11,3*5,3*7,3*11,5*7,5*11,7*11,3*5*7,3*5*11,3*7*11,5*7*11,3*5*7*11};
+            unsigned long long s=isqrt(n);
+            if(s*s==n)
+                return s;
+            for(unsigned int k=0; k<16 && n<=~0ULL/multipliers[k]; ++k){
+                unsigned long long d=multipliers[k]*n;
+                unsigned long long p0=isqrt(d);
+                unsigned long long p=p0, pprev=p0;
+                unsigned long long qprev=1;
+                unsigned long long q=d-p0*p0;
+                if(!q)
+                    continue;
+                unsigned long long bound=6*isqrt(2*s);
+                unsigned long long r=0;
+                unsigned long long i=2;
+                // forward until Q is a square on an even step
+                for(; i<bound; ++i){
+                    unsigned long long b=(p0+p)/q;
+                    p=b*q-p;
+                    unsigned long long t=q;
+                    q=qprev+b*(pprev-p);
+                    r=isqrt(q);
+                    if(!(i&1) && r*r==q)
+                        break;
+                    qprev=t;
+                    pprev=p;
+                }
+                if(i>=bound || !r)
+                    continue;
+                // then the reverse cycle, until P repeats
+                unsigned long long b=(p0-p)/r;
+                p=b*r+p;
+                pprev=p;
+                qprev=r;
+                q=(d-p*p)/r;
+                if(!q)
+                    continue;
+                for(i=0; i<bound; ++i){
+                    b=(p0+p)/q;
+                    pprev=p;
+                    p=b*q-p;
+                    unsigned long long t=q;
+                    q=qprev+b*(pprev-p);
+                    qprev=t;
+                    if(p==pprev)
+                        break;
+                }
+                r=gcd(n,qprev);
+                if(r!=1 && r!=n)
+                    return r;
             }
-            if(exp){
-                factors[numfacs]=13;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
-            }
-            unsigned int b = 1;
-            unsigned int p = 17;
-            while(p*p<=n){
-                while(!(n%p)){
-                    ++exp;
-                    n/=p;
+            return 0;
+        }
+
+        // Some factor of a composite n with no prime factors below trialbound, other than 1 or n.
+        static unsigned long long splitFactor(unsigned long long n){
+            unsigned long long r=isqrt(n);
+            if(r*r==n)
+                return r;
+            unsigned long long d=0;
+            for(unsigned long long c=1; c<=8 && !d; c+=4)
+                d=pollardBrent(n,c,24);
+            if(!d)
+                d=squfof(n);
+            for(unsigned long long c=9; !d; c+=4)
+                d=pollardBrent(n,c,64);
+            return d;
+        }
+
+        // Factors n, which has no prime factors below trialbound and isn't prime if it's below trialbound^2,
+        // into the arrays the same way factor does, with the factors in increasing order.
+        template<class T> static unsigned char factorLarge(unsigned long long n, T* factors, unsigned char* exponents){
+            unsigned long long pending[16];
+            unsigned long long primes[16];
+            unsigned char numpending=1, numprimes=0;
+            pending[0]=n;
+            while(numpending){
+                unsigned long long m=pending[--numpending];
+                if(isProbablePrime(m))
+                    primes[numprimes++]=m;
+                else{
+                    unsigned long long d=splitFactor(m);
+                    pending[numpending++]=d;
+                    pending[numpending++]=m/d;
                 }
-                if(exp){
-                    factors[numfacs]=p;
-                    exponents[numfacs]=exp;
+            }
+            std::sort(primes,primes+numprimes);
+            unsigned char numfacs=0;
+            for(unsigned char i=0; i<numprimes; ++i){
+                if(numfacs && factors[numfacs-1]==primes[i])
+                    ++exponents[numfacs-1];
+                else{
+                    factors[numfacs]=primes[i];
+                    exponents[numfacs]=1;
                     ++numfacs;
-                    exp=0;
                 }
-                ++b;
-                while(!sieve[b])
-                    ++b;
-                p = b/5760*30030+conversions[b%5760];
-            }
-            if(n>1){
-                factors[numfacs]=n;
-                exponents[numfacs]=1;
-                ++numfacs;
             }
             return numfacs;
         }
-        unsigned char factorSmallWheel(unsigned int n, unsigned int* factors, unsigned char* exponents){
-            unsigned char exp=0;
-            unsigned char numfacs=0;
-            while(!(n&1U)){
-                ++exp;
-                n>>=1;
-            }
-            if(exp){
-                factors[0]=2;
-                exponents[0]=exp;
-                numfacs=1;
-                exp=0;
-            }
-            while(!(n%3)){
-                ++exp;
-                n/=3;
-            }
-            if(exp){
-                factors[numfacs]=3;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
+
+        // How isPrimeWith and factorWith get the primes up to sqrt(n): Grow sieves as far as it needs to,
+        // Unsafe assumes the sieve is already there, and Wheel trial divides by everything on the wheel instead.
+        enum Lookup { Grow, Unsafe, Wheel };
+
+        template<class T, int lookup> bool isPrimeWith(T n){
+            ZMATH_COUNT(IsPrimeCalls,1);
+            if(n==2 || n==3 || n==5 || n==7 || n==11 || n==13)
+                return true;
+            if(!(n&1U) || !(n%3) || !(n%5) || !(n%7) || !(n%11) || !(n%13))
+                return false;
+            if(lookup==Wheel){
+                if(n==1)
+                    return false;
+                unsigned long long sqrtn=isqrt(n);
+                unsigned int end=std::min(wheelCount(sqrtn),+TrialDivisors::count);
+                if(firstMultiple(n,1,end)<end)
+                    return false;
+                if(end<TrialDivisors::count)
+                    return true;
+                unsigned long long p=65537;
+                unsigned short w=TrialDivisors::count%5760;
+                while(p<=sqrtn){
+                    if(!(n%p))
+                        return false;
+                    p+=wheel[w];
+                    ++w;
+                    w%=5760;
+                }
+                return true;
             }
-            while(!(n%5)){
-                ++exp;
-                n/=5;
+            if(lookup==Unsafe || n<=maxstored)
+                return sieve[n/30030*5760+indexes[n%30030]];
+            return n<289 ? n!=1 : isProbablePrime(n);
+        }
+
+        // Returns the sieve bit for n, or ~0 after setting out to the answer, if n is divisible by 2, 3, 5, 7, 11, or 13,
+        // or the sieve doesn't go that far. One division by 30030 does the small primes and finds the bit.
+        template<class T> unsigned long long batchBit(T n, unsigned char& out){
+            T q=n/30030;
+            unsigned int r=n-q*30030;
+            unsigned int b=indexes[r];
+            if(b==5760 || conversions[b]!=r)
+                out=n==2 || n==3 || n==5 || n==7 || n==11 || n==13;
+            else if(n<=maxstored)
+                return q*5760ULL+b;
+            else
+                out=n<289 ? n!=1 : isProbablePrime(n);
+            return ~0ULL;
+        }
+        template<class T> void isPrimeBatchWith(const T* in, size_t n, unsigned char* out, bool sorted){
+            ZMATH_COUNT(IsPrimeBatchNumbers,n);
+            const unsigned long long* words=sieve.data();
+            if(sorted){
+                std::vector<std::pair<unsigned long long,size_t> > lookups;
+                lookups.reserve(n);
+                for(size_t i=0; i<n; ++i){
+                    unsigned long long b=batchBit(in[i],out[i]);
+                    if(b!=~0ULL)
+                        lookups.push_back(std::make_pair(b,i));
+                }
+                std::sort(lookups.begin(),lookups.end());
+                for(size_t i=0; i<lookups.size(); ++i)
+                    out[lookups[i].second]=words[lookups[i].first>>6]>>(lookups[i].first&63)&1;
+                return;
             }
-            if(exp){
-                factors[numfacs]=5;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
+            // 64 misses at a time is more than the memory system can have in flight, so a bigger block wouldn't help
+            unsigned long long bits[64];
+            for(size_t i=0; i<n; i+=64){
+                size_t m=std::min(n-i,(size_t)64);
+                for(size_t j=0; j<m; ++j){
+                    bits[j]=batchBit(in[i+j],out[i+j]);
+                    if(bits[j]!=~0ULL)
+                        __builtin_prefetch(words+(bits[j]>>6));
+                }
+                for(size_t j=0; j<m; ++j){
+                    if(bits[j]!=~0ULL)
+                        out[i+j]=words[bits[j]>>6]>>(bits[j]&63)&1;
+                }
             }
-            while(!(n%7)){
+        }
+
+        // Divides n by p as many times as it goes, and adds p to the factors if it went at all
+        template<class T> static void divideOut(T& n, T p, T* factors, unsigned char* exponents, unsigned char& numfacs){
+            unsigned char exp=0;
+            while(!(n%p)){
                 ++exp;
-                n/=7;
+                n/=p;
             }
             if(exp){
-                factors[numfacs]=7;
+                factors[numfacs]=p;
                 exponents[numfacs]=exp;
                 ++numfacs;
-                exp=0;
             }
-            while(!(n%11)){
+        }
+
+        // The number of wheel numbers up to n, which is also the bit for the first one after n
+        static unsigned int wheelCount(unsigned long long n){
+            return (n+1)/30030*5760+indexes[(n+1)%30030];
+        }
+        // Whether n is a multiple of the bth wheel number, for b below TrialDivisors::count
+        template<class T> static bool multipleOf(T n, unsigned int b){
+            const TrialDivisors& d=SharedWheelTables<>::divisors;
+            return (T)(n*(T)d.inverse[b])<=(T)(d.limit[b]>>(64-8*sizeof(T)));
+        }
+        // Returns the first b from b up to end, at most TrialDivisors::count, where n is a multiple of the bth wheel number,
+        // or b if it's already past end, or end if there isn't one.
+        static unsigned int firstMultiple(unsigned long long n, unsigned int b, unsigned int end){
+            while(b<end && !multipleOf(n,b))
+                ++b;
+            return b;
+        }
+        // 32-bit numbers are tested 16 at a time with AVX-512, or 8 at a time with AVX2, if the processor has it
+        static unsigned int firstMultiple(unsigned int n, unsigned int b, unsigned int end){
+#if defined(__x86_64__) || defined(__i386__)
+            static const int simd=[]{
+                __builtin_cpu_init();
+                return __builtin_cpu_supports("avx512f") ? 2 : __builtin_cpu_supports("avx2") ? 1 : 0;
+            }();
+            if(simd==2)
+                b=firstMultipleAVX512(n,b,end);
+            else if(simd==1)
+                b=firstMultipleAVX2(n,b,end);
+#endif
+            while(b<end && !multipleOf(n,b))
+                ++b;
+            return b;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        // These stop at the first block with a multiple in it, or the last whole block, and leave the rest to firstMultiple
+        __attribute__((target("avx2"))) static unsigned int firstMultipleAVX2(unsigned int n, unsigned int b, unsigned int end){
+            const TrialDivisors& d=SharedWheelTables<>::divisors;
+            __m256i nv=_mm256_set1_epi32(n);
+            for(; b+8<=end; b+=8){
+                __m256i q=_mm256_mullo_epi32(nv,_mm256_loadu_si256((const __m256i*)(d.inverse32+b)));
+                // q<=limit exactly when min(q,limit)==q
+                __m256i le=_mm256_cmpeq_epi32(_mm256_min_epu32(q,_mm256_loadu_si256((const __m256i*)(d.limit32+b))),q);
+                if(_mm256_movemask_ps(_mm256_castsi256_ps(le)))
+                    break;
+            }
+            return b;
+        }
+        __attribute__((target("avx512f"))) static unsigned int firstMultipleAVX512(unsigned int n, unsigned int b, unsigned int end){
+            const TrialDivisors& d=SharedWheelTables<>::divisors;
+            __m512i nv=_mm512_set1_epi32(n);
+            for(; b+16<=end; b+=16){
+                __m512i q=_mm512_mullo_epi32(nv,_mm512_loadu_si512(d.inverse32+b));
+                if(_mm512_cmple_epu32_mask(q,_mm512_loadu_si512(d.limit32+b)))
+                    break;
+            }
+            return b;
+        }
+#endif
+        // The same as divideOut, for the bth wheel number, below TrialDivisors::count, without dividing
+        template<class T> static void divideOutWheel(T& n, unsigned int b, T* factors, unsigned char* exponents, unsigned char& numfacs){
+            const TrialDivisors& d=SharedWheelTables<>::divisors;
+            T inverse=d.inverse[b];
+            T limit=d.limit[b]>>(64-8*sizeof(T));
+            unsigned char exp=0;
+            while((T)(n*inverse)<=limit){
                 ++exp;
-                n/=11;
+                n*=inverse;
             }
             if(exp){
-                factors[numfacs]=11;
+                factors[numfacs]=b/5760*30030+conversions[b%5760];
                 exponents[numfacs]=exp;
                 ++numfacs;
-                exp=0;
             }
-            while(!(n%13)){
-                ++exp;
-                n/=13;
+        }
+
+        template<class T, int lookup> unsigned char factorWith(T n, T* factors, unsigned char* exponents){
+            ZMATH_COUNT(FactorCalls,1);
+            unsigned char numfacs=0;
+            if(!(n&1U)){
+                unsigned char exp=__builtin_ctzll(n);
+                n>>=exp;
+                factors[0]=2;
+                exponents[0]=exp;
+                numfacs=1;
             }
-            if(exp){
-                factors[numfacs]=13;
-                exponents[numfacs]=exp;
-                ++numfacs;
-                exp=0;
-            }
-            unsigned int p=17;
-            unsigned short w=1;
-            while(p*p<=n){
-                while(!(n%p)){
-                    ++exp;
-                    n/=p;
+            divideOut<T>(n,3,factors,exponents,numfacs);
+            divideOut<T>(n,5,factors,exponents,numfacs);
+            divideOut<T>(n,7,factors,exponents,numfacs);
+            divideOut<T>(n,11,factors,exponents,numfacs);
+            divideOut<T>(n,13,factors,exponents,numfacs);
+            T p=17;
+            if(lookup==Wheel){
+                // Everything on the wheel below 2^16 goes through the table, and only what's left is divided
+                unsigned int end=std::min(wheelCount(isqrt(n)),+TrialDivisors::count);
+                unsigned int b=firstMultiple(n,1,end);
+                while(b<end){
+                    divideOutWheel(n,b,factors,exponents,numfacs);
+                    end=std::min(wheelCount(isqrt(n)),+TrialDivisors::count);
+                    b=firstMultiple(n,b+1,end);
                 }
-                if(exp){
-                    factors[numfacs]=p;
-                    exponents[numfacs]=exp;
-                    ++numfacs;
-                    exp=0;
+                p=b/5760*30030+conversions[b%5760];
+                unsigned short w=b%5760;
+                // (bounded by isqrt, since p*p wraps around once p passes 2^16 or 2^32)
+                unsigned long long sqrtn=isqrt(n);
+                while(p<=sqrtn){
+                    T before=n;
+                    divideOut(n,p,factors,exponents,numfacs);
+                    if(n!=before)
+                        sqrtn=isqrt(n);
+                    p+=wheel[w];
+                    ++w;
+                    w%=5760;
                 }
-                p+=wheel[w];
-                ++w;
-                w%=5760;
+            }else{
+                // With Grow, only the primes below trialbound are divided out. Whatever is left over is split by Pollard-Brent rho.
+                if(lookup==Grow)
+                    doSieve(trialbound);
+                unsigned int b=1;
+                unsigned long long sqrtn=isqrt(n);
+                while((lookup==Unsafe || p<trialbound) && p<=sqrtn){
+                    T before=n;
+                    if(b<TrialDivisors::count)
+                        divideOutWheel(n,b,factors,exponents,numfacs);
+                    else
+                        divideOut(n,p,factors,exponents,numfacs);
+                    if(n!=before)
+                        sqrtn=isqrt(n);
+                    b=sieve.next(b+1);
+                    p=b/5760*30030+conversions[b%5760];
+                }
+                if(lookup==Grow && p<=sqrtn)
+                    return numfacs+factorLarge(n,factors+numfacs,exponents+numfacs);
             }
             if(n>1){
                 factors[numfacs]=n;
@@ -835,446 +3091,221 @@ class PrimeData {
             return numfacs;
         }
 
-        unsigned long long primesUpTo(unsigned long long n, std::vector<unsigned long long>& primes){
-            buildSieveTo(n);
-            if(n>=60184)
-                primes.reserve((unsigned long long)(n/(log(n)-1.1)));
-            else if(n>=17)
-                primes.reserve((unsigned int)(1.25506*n/log(n)));
-            else
-                primes.reserve(6);
-            unsigned long long t=0;
-            if(n>=2){
-                primes[0]=2;
-                t=1;
-            }
-            if(n>=3){
-                primes[1]=3;
-                t=2;
-            }
-            if(n>=5){
-                primes[2]=5;
-                t=3;
-            }
-            if(n>=7){
-                primes[3]=7;
-                t=4;
-            }
-            if(n>=11){
-                primes[4]=11;
-                t=5;
-            }
-            if(n>=13){
-                primes[5]=13;
-                t=6;
-            }
-            if(n>=17){
-                unsigned long long b=1;
-                unsigned long long p=17;
-                if(n<=4289995710U){
-                    while(p<=n){
-                        primes[t]=p;
-                        ++t;
-                        ++b;
-                        while(!sieve[b])
-                            ++b;
-                        p=b/5760*30030+conversions[b%5760];
-                    }
-                }else{
-                    while(b<822856320){
-                        primes[t]=p;
-                        ++t;
-                        ++b;
-                        while(!sieve[b])
-                            ++b;
-                        p=b/5760*30030+conversions[b%5760];
-                    }
-                    b=3;
-                    p=4289995733U;
-                    while(p<=n){
-                        primes[t]=p;
-                        ++t;
-                        ++b;
-                        while(!bigsieve[b])
-                            ++b;
-                        p=b/5760*30030+conversions[b%5760]+4289995710U;
-                    }
-                }
-            }
-            return t;
-        }
-        unsigned int primesUpToSmall(unsigned int n, std::vector<unsigned int>& primes){
-            if(n>=60184){
-                primes.reserve((unsigned int)(n/(log(n)-1.1)));
-                doSieve(n);
-            }else if(n>=17){
-                primes.reserve((unsigned int)(1.25506*n/log(n)));
-                doSieve(n);
-            }else
-                primes.reserve(6);
-            unsigned int t=0;
-            if(n>=2){
-                primes[0]=2;
-                t=1;
-            }
-            if(n>=3){
-                primes[1]=3;
-                t=2;
-            }
-            if(n>=5){
-                primes[2]=5;
-                t=3;
-            }
-            if(n>=7){
-                primes[3]=7;
-                t=4;
-            }
-            if(n>=11){
-                primes[4]=11;
-                t=5;
-            }
-            if(n>=13){
-                primes[5]=13;
-                t=6;
-            }
-            if(n>=17){
-                unsigned int b=1;
-                unsigned int p=17;
-                while(p<=n){
-                    primes[t]=p;
-                    ++t;
-                    ++b;
-                    while(!sieve[b])
-                        ++b;
-                    p=b/5760*30030+conversions[b%5760];
-                }
-            }
-            return t;
-        }
-
-        unsigned long long numPrimesUpTo(unsigned long long n){
-            buildSieveTo(n);
-            if(n>=17){
-                unsigned long long t=6;
-                unsigned long long b=1;
-                unsigned long long maxb=n/1001*192; // this can put maxb up to 2 greater than where it should be
-                if(n%30030){
-                    if(maxb/5760*30030+conversions[maxb%5760]>n) // maxb is at most 1 greater than where it should be
-                        --maxb;
-                    while(maxb/5760*30030+conversions[maxb%5760]<n) // force maxb up to equal (prime) or 1 greater (composite) than where it should be
-                        ++maxb;
-                    if(maxb/5760*30030+conversions[maxb%5760]>n) // put maxb where it should be
-                        --maxb;
-                }else if(maxb)
-                    --maxb;
-                if(n<=4289995710U){
-                    while(b<=maxb){
-                        ++t;
-                        ++b;
-                        while(!sieve[b])
-                            ++b;
-                    }
-                }else{
-                    t=203056267;
-                    b=3;
-                    maxb-=822856320;
-                    while(b<=maxb){
-                        ++t;
-                        ++b;
-                        while(!bigsieve[b])
-                            ++b;
-                    }
-                }
-                return t;
-            }else if(n>=13)
-                return 6;
-            else if(n>=11)
-                return 5;
-            else if(n>=7)
-                return 4;
-            else if(n>=5)
-                return 3;
-            else if(n>=3)
-                return 2;
-            else if(n>=2)
-                return 1;
-            else
+        // How far forEachPrime(lo,hi) will grow the sieve to, or 0 if it won't
+        unsigned long long forEachPrimeReach(unsigned long long lo, unsigned long long hi) const {
+            hi=std::min(hi,~0ULL-1);
+            lo=std::max(std::max(lo,17ULL),maxstored+1);
+            if(lo>hi || hi-lo<isqrt(hi)/64 || !fits(isqrt(hi)+1))
                 return 0;
+            return isqrt(hi)+1;
         }
-        unsigned int numPrimesUpToSmall(unsigned int n){
-            doSieve(n);
-            if(n>=17){
-                unsigned int t=6;
-                unsigned int b=1;
-                unsigned int maxb=n/1001*192; // this can put maxb up to 2 greater than where it should be
-                if(n%30030){
-                    if(maxb/5760*30030+conversions[maxb%5760]>n) // maxb is at most 1 greater than where it should be
-                        --maxb;
-                    while(maxb/5760*30030+conversions[maxb%5760]<n) // force maxb up to equal (prime) or 1 greater (composite) than where it should be
-                        ++maxb;
-                    if(maxb/5760*30030+conversions[maxb%5760]>n) // put maxb where it should be
-                        --maxb;
-                }else if(maxb)
-                    --maxb;
-                if(n<=4289995710U){
-                    while(b<=maxb){
-                        ++t;
-                        ++b;
-                        while(!sieve[b])
-                            ++b;
-                    }
-                }else{
-                    t=203056267;
-                    b=3;
-                    maxb-=822856320;
-                    while(b<=maxb){
-                        ++t;
-                        ++b;
-                        while(!bigsieve[b])
-                            ++b;
-                    }
-                }
-                return t;
-            }else if(n>=13)
-                return 6;
-            else if(n>=11)
-                return 5;
-            else if(n>=7)
-                return 4;
-            else if(n>=5)
-                return 3;
-            else if(n>=3)
-                return 2;
-            else if(n>=2)
-                return 1;
-            else
+
+        // How far nthPrime(k) will grow the sieve to, at most. The kth prime is below k*(log(k)+log(log(k))) once k is at least 6,
+        // and the windows nthPrime sieves around its guess can't go more than a sixteenth (or one window) past that.
+        static unsigned long long nthPrimeReach(unsigned long long k){
+            if(k<=6 || k>425656284035217743ULL)
                 return 0;
+            double bound=k*(log(k)+log(log(k)));
+            bound+=bound/16+65536;
+            return isqrt(bound>=18446744073709549568.0 ? ~0ULL-1 : (unsigned long long)bound)+1;
         }
 
-        void firstPrimes(unsigned long long n, std::vector<unsigned long long>& primes){
-            primes.reserve(n);
-            buildSieveTo(n*log(n*log(n)));
-            unsigned int t=0;
-            if(n>=1){
-                primes[0]=2;
-                t=1;
-            }
-            if(n>=2){
-                primes[1]=3;
-                t=2;
-            }
-            if(n>=3){
-                primes[2]=5;
-                t=3;
-            }
-            if(n>=4){
-                primes[3]=7;
-                t=4;
-            }
-            if(n>=5){
-                primes[4]=11;
-                t=5;
-            }
-            if(n>=6){
-                primes[5]=13;
-                t=6;
-            }
-            if(n>=7){
-                unsigned long long b=1;
-                unsigned long long p=17;
-                if(n<=203056267){
-                    while(t<n){
-                        primes[t]=p;
-                        ++t;
-                        if(t<n){
-                            ++b;
-                            while(!sieve[b])
-                                ++b;
-                            p=b/5760*30030+conversions[b%5760];
-                        }
-                    }
-                }else{
-                    while(b<822856320){
-                        primes[t]=p;
-                        ++t;
-                        ++b;
-                        while(!sieve[b])
-                            ++b;
-                        p=b/5760*30030+conversions[b%5760];
-                    }
-                    b=3;
-                    p=4289995733U;
-                    while(t<n){
-                        primes[t]=p;
-                        ++t;
-                        ++b;
-                        while(!bigsieve[b])
-                            ++b;
-                        p=b/5760*30030+conversions[b%5760]+4289995710U;
-                    }
-                }
-            }
+        // Sieves up to at least n, for the functions that extend the sieve on their own. When it has to grow, it at least doubles,
+        // so calling them with increasing inputs only extends it a logarithmic number of times, instead of a little bit every call.
+        // Returns false, without sieving anything, if n is past what the memory limit allows.
+        bool growSieveTo(unsigned long long n){
+            if(n<=maxstored)
+                return true;
+            if(!fits(n))
+                return false;
+            sieveTo(std::max(n,std::min(2*maxstored,largestFit())));
+            return true;
         }
-        void firstPrimesSmall(unsigned int n, std::vector<unsigned int>& primes){
-            primes.reserve(n);
-            if(n<=194682290)
-                doSieve((unsigned int)(n*log(n*log(n))));
-            else
+
+        void sieveTo(unsigned long long n){
+            if(n<=4289995710U)
+                doSieve(n);
+            else{
                 doSieve(4289995710U);
-            unsigned int t=0;
-            if(n>=1){
-                primes[0]=2;
-                t=1;
-            }
-            if(n>=2){
-                primes[1]=3;
-                t=2;
-            }
-            if(n>=3){
-                primes[2]=5;
-                t=3;
-            }
-            if(n>=4){
-                primes[3]=7;
-                t=4;
-            }
-            if(n>=5){
-                primes[4]=11;
-                t=5;
-            }
-            if(n>=6){
-                primes[5]=13;
-                t=6;
-            }
-            if(n>=7){
-                unsigned int b=1;
-                unsigned int p=17;
-                while(t<n){
-                    primes[t]=p;
-                    ++t;
-                    if(t<n){
-                        ++b;
-                        while(!sieve[b])
-                            ++b;
-                        p=b/5760*30030+conversions[b%5760];
-                    }
-                }
+                doBigSieve(n);
             }
         }
-
-    private:
-        unsigned short conversions[5760];
-        unsigned char wheel[5760];
-        unsigned short indexes[30030] = {0};
-        unsigned int maxsieve = 0;
-        unsigned long long maxbigsieve = 4289995710U;
-        unsigned int maxbool = 1;
-        unsigned long long maxbigbool = 0;
-        std::vector<bool> sieve;
-        std::vector<bool> bigsieve;
-
         void doSieve(unsigned int n){
             if(n<=maxsieve)
                 return;
             if(n%30030)
                 n+=30030-n%30030; // Round up to nearest multiple of 2*3*5*7*11*13
             maxbool=n/1001*192;
-            sieve.resize(maxbool+1,1);
-            unsigned int sqrtn=sqrt(n);
-
-            unsigned int b=1;
-            unsigned int p=17;
-            while(p<=sqrtn){
-                // no need to sieve below p^2
-                unsigned int mins=std::max(maxsieve,p*p);
-
-                // s starts out at mins rounded down to a multiple of 30030*p, plus p,
-                // and then hits all multiples of p not divisible by 2, 3, 5, 7, 11, or 13
-                unsigned int s=mins-mins%(30030*p)+p;
-                unsigned short w=0;
-                if(s==p){
-                    s+=16*p;
-                    w=1;
-                }
-                while(s<mins){
-                    s+=p*wheel[w];
-                    ++w;
-                }
-                w%=5760;
-                while(s<n){
-                    sieve[s/30030*5760+indexes[s%30030]]=0;
-                    s+=p*wheel[w];
-                    ++w;
-                    w%=5760;
-                }
-                ++b;
-                while(!sieve[b])
-                    ++b;
-                p = b/5760*30030+conversions[b%5760];
-            }
+            ZMATH_COUNT(SieveExtensions,1);
+            ZMATH_COUNT(SieveResizes,(maxbool+64)/64>sieve.bytes()/8);
+            sieve.resize(maxbool+1);
+            extendSieve(maxsieve,n);
             maxsieve = n;
+            maxstored = n<4289995710U ? n : maxbigsieve;
+            updateRanks();
         }
         void doBigSieve(unsigned long long n){
             if(n<=maxbigsieve)
                 return;
             if(n%30030)
                 n+=30030-n%30030; // Round up to nearest multiple of 2*3*5*7*11*13
-            maxbigbool=n/1001*192-822856320;
-            bigsieve.resize(maxbigbool+1,1);
-            unsigned int sqrtn=sqrt(n);
-
-            unsigned long long b=1;
-            unsigned int p = 17;
-            while(p<=sqrtn){
-                // no need to sieve below p^2
-                unsigned long long mins=std::max(maxbigsieve,(unsigned long long)p*p);
-
-                // s starts out at mins rounded down to a multiple of 30030*p, plus p,
-                // and then hits all multiples of p not divisible by 2, 3, 5, 7, 11, or 13
-                unsigned long long s=mins-mins%(30030*p)+p;
-                unsigned short w=0;
-                while(s<mins){
-                    s+=p*wheel[w];
-                    ++w;
-                }
-                w%=5760;
-
-                // Using this block instead of the block directly above should optimize getting s above mins,
-                // because it is bidrectional, cutting the time in half.
-                // However, testing revealed no difference, and if anything, a slight increase.
-/*                unsigned short w;
-                unsigned long long multp = 30030*p;
-                unsigned long long testhalf = mins%(multp);
-                unsigned long long s=mins-testhalf;
-                if(testhalf*2<multp){
-                    s+=p;
-                    w=0;
-                    while(s<mins){
-                        s+=p*wheel[w];
-                        ++w;
-                    }
-                }else{
-                    s+=multp-p;
-                    w=5759;
-                    while(s>=mins){
-                        --w;
-                        s-=p*wheel[w];
-                    }
-                    s+=p*wheel[w];
-                    ++w;
-                }*/
-
-                while(s<n){
-                    bigsieve[s/30030*5760+indexes[s%30030]-822856320]=0;
-                    s+=p*wheel[w];
-                    ++w;
-                    w%=5760;
-                }
-                ++b;
-                while(!sieve[b])
-                    ++b;
-                p = b/5760*30030+conversions[b%5760];
-            }
+            maxbigbool=n/1001*192;
+            ZMATH_COUNT(SieveExtensions,1);
+            ZMATH_COUNT(SieveResizes,(maxbigbool+64)/64>sieve.bytes()/8);
+            sieve.resize(maxbigbool+1);
+            extendSieve(maxbigsieve,n);
             maxbigsieve = n;
+            maxstored = n;
+            updateRanks();
+        }
+};
+
+// One sieve shared between threads. Each query reads a PrimeData that has been published and is never changed again,
+// as long as it already goes far enough for that query, so the common case doesn't lock or write anything shared.
+// When it doesn't, the query takes the lock, copies the PrimeData, grows the copy, and publishes it in place of the old one.
+class ConcurrentPrimeData {
+    public:
+        ConcurrentPrimeData() : ConcurrentPrimeData(PrimeData()) {}
+        // Takes over start, with its sieve, thread count, and rank index
+        explicit ConcurrentPrimeData(PrimeData&& start){
+            PrimeData* s=new PrimeData(std::move(start));
+            // factor sieves this far on its first call, so it has to be done before anything is shared
+            s->doSieve(PrimeData::trialbound);
+            current.store(s,std::memory_order_release);
+        }
+        ConcurrentPrimeData(const ConcurrentPrimeData&)=delete;
+        ConcurrentPrimeData& operator=(const ConcurrentPrimeData&)=delete;
+        ~ConcurrentPrimeData(){
+            reclaim();
+            delete current.load(std::memory_order_relaxed);
+        }
+
+        // Grows the sieve to exactly n, if it doesn't already go that far
+        void buildSieveTo(unsigned long long n){
+            reaching(n,true);
+        }
+        // Frees the PrimeData that have been replaced. There must not be any queries running on other threads.
+        void reclaim(){
+            std::lock_guard<std::mutex> lock(writer);
+            for(size_t i=0; i<retired.size(); ++i)
+                delete retired[i];
+            retired.clear();
+        }
+
+        bool isPrime(unsigned long long n){
+            return published()->isPrime(n);
+        }
+        bool isPrimeSmall(unsigned int n){
+            return published()->isPrimeSmall(n);
+        }
+        void isPrimeBatch(const unsigned long long* in, size_t n, unsigned char* out, bool sorted=false){
+            published()->isPrimeBatch(in,n,out,sorted);
+        }
+        void isPrimeSmallBatch(const unsigned int* in, size_t n, unsigned char* out, bool sorted=false){
+            published()->isPrimeSmallBatch(in,n,out,sorted);
+        }
+        unsigned char factor(unsigned long long n, unsigned long long* factors, unsigned char* exponents){
+            return published()->factor(n,factors,exponents);
+        }
+        unsigned char factorSmall(unsigned int n, unsigned int* factors, unsigned char* exponents){
+            return published()->factorSmall(n,factors,exponents);
+        }
+        unsigned long long numPrimesUpTo(unsigned long long n){
+            PrimeData* s=published();
+            // the same bound numPrimesUpTo grows the sieve to
+            if(n>s->maxstored)
+                s=reaching(sqrt(n)+1);
+            return s->numPrimesUpTo(n);
+        }
+        unsigned int numPrimesUpToSmall(unsigned int n){
+            return numPrimesUpTo(n);
+        }
+        unsigned long long numPrimesUpToLMO(unsigned long long n){
+            // LMO sieves up to sqrt(n), and below 1000 it's numPrimesUpTo
+            return reaching(sqrt(n)+1)->numPrimesUpToLMO(n);
+        }
+        template<class F> void forEachPrime(unsigned long long lo, unsigned long long hi, F f){
+            PrimeData* s=published();
+            s=reaching(s->forEachPrimeReach(lo,hi));
+            s->forEachPrime(lo,hi,f);
+        }
+        unsigned long long primesUpTo(unsigned long long n, std::vector<unsigned long long>& primes){
+            PrimeData* s=published();
+            s=reaching(s->forEachPrimeReach(0,n));
+            return s->primesUpTo(n,primes);
+        }
+        unsigned long long primesUpTo(unsigned long long n, PrimeList& primes){
+            PrimeData* s=published();
+            s=reaching(s->forEachPrimeReach(0,n));
+            return s->primesUpTo(n,primes);
+        }
+        unsigned int primesUpToSmall(unsigned int n, std::vector<unsigned int>& primes){
+            PrimeData* s=published();
+            s=reaching(s->forEachPrimeReach(0,n));
+            return s->primesUpToSmall(n,primes);
+        }
+        void firstPrimes(unsigned long long n, std::vector<unsigned long long>& primes){
+            PrimeData* s=published();
+            s=reaching(s->forEachPrimeReach(0,PrimeData::firstPrimesBound(n)));
+            s->firstPrimes(n,primes);
+        }
+        void firstPrimes(unsigned long long n, PrimeList& primes){
+            PrimeData* s=published();
+            s=reaching(s->forEachPrimeReach(0,PrimeData::firstPrimesBound(n)));
+            s->firstPrimes(n,primes);
+        }
+        void firstPrimesSmall(unsigned int n, std::vector<unsigned int>& primes){
+            PrimeData* s=published();
+            s=reaching(s->forEachPrimeReach(0,std::min(PrimeData::firstPrimesBound(n),4289995710ULL)));
+            s->firstPrimesSmall(n,primes);
+        }
+        unsigned long long nthPrime(unsigned long long k){
+            return reaching(PrimeData::nthPrimeReach(k))->nthPrime(k);
+        }
+        PrimeWindow sieveRange(unsigned long long lo, unsigned long long hi){
+            if(lo>hi)
+                return PrimeWindow();
+            return reaching(PrimeData::isqrt(std::min(hi,~0ULL-1))+1)->sieveRange(lo,hi);
+        }
+        unsigned long long primesInRange(unsigned long long lo, unsigned long long hi, std::vector<unsigned long long>& primes){
+            PrimeData* s=published();
+            s=reaching(s->forEachPrimeReach(lo,hi));
+            return s->primesInRange(lo,hi,primes);
+        }
+        template<class F> void factorRange(unsigned long long lo, unsigned long long hi, F f){
+            if(lo<=hi)
+                reaching(PrimeData::isqrt(hi)+1)->factorRange(lo,hi,f);
+        }
+        void smallestFactors(unsigned long long lo, unsigned long long hi, unsigned long long* spf){
+            if(lo<=hi)
+                reaching(PrimeData::isqrt(hi)+1)->smallestFactors(lo,hi,spf);
+        }
+
+    private:
+        std::atomic<PrimeData*> current;
+        std::mutex writer;
+        std::vector<PrimeData*> retired;
+
+        PrimeData* published(){
+            return current.load(std::memory_order_acquire);
+        }
+        // Returns a published PrimeData whose sieve goes up to at least n, publishing a new one if it has to.
+        // Unless exact is set, the new one goes at least twice as far, the same as PrimeData grows on its own.
+        PrimeData* reaching(unsigned long long n, bool exact=false){
+            PrimeData* s=published();
+            // past the memory limit, the queries fall back on their own, without growing the sieve
+            if(!s->fits(n))
+                n=s->largestFit();
+            if(n<=s->maxstored)
+                return s;
+            std::lock_guard<std::mutex> lock(writer);
+            s=current.load(std::memory_order_relaxed);
+            if(n<=s->maxstored)
+                return s;
+            PrimeData* next=new PrimeData(*s);
+            next->buildSieveTo(exact ? n : std::max(n,2*s->maxstored));
+            retired.push_back(s);
+            current.store(next,std::memory_order_release);
+            return next;
         }
 };
@@ -0,0 +1,341 @@
+/*
+
+Benchmarks for zmath.cpp. It reruns the timing table at the top of zmath.cpp, along with the rest of the public functions,
+    and prints the results as JSON, so two runs (or two machines, or two builds) can be compared line by line.
+
+Build it the same way as anything else that uses zmath.cpp:
+    g++ -std=c++14 -O3 -pthread zmath_bench.cpp -o zmath_bench
+
+Usage:
+    ./zmath_bench [max] [threads] > bench.json
+
+max is the largest size in the table to run (the sizes are 1 billion, 2 billion, 4289995710, 5 billion, 10 billion, and 15 billion),
+    1 billion by default, since the whole table takes a few minutes and a few gigabytes.
+threads is passed to setThreads, 1 by default, which matches the table.
+Progress goes to stderr.
+
+Every result has the time per call in ns_per_op, primes per second where the function produces primes,
+    and the peak resident memory while it ran, in peak_rss_kb. On Linux the peak is reset before each one, so it's just that function's;
+    elsewhere it's the peak of the whole run so far.
+check is a sum of what the function returned, so a run that gets faster by getting the wrong answer shows up too.
+The random queries come from a fixed seed, so they're the same numbers every run.
+
+*/
+
+
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include "zmath.cpp"
+
+struct BenchResult {
+    std::string name;
+    unsigned long long n;
+    unsigned long long ops;
+    double seconds;
+    unsigned long long primes;
+    long long peakKB;
+    unsigned long long check;
+};
+
+static std::vector<BenchResult> results;
+
+static void resetPeakRSS(){
+    // writing 5 to clear_refs resets VmHWM, the peak resident set size
+    FILE* f=fopen("/proc/self/clear_refs","w");
+    if(f){
+        fputs("5",f);
+        fclose(f);
+    }
+}
+
+static long long peakRSS(){
+    FILE* f=fopen("/proc/self/status","r");
+    if(f){
+        char line[256];
+        long long kb=-1;
+        while(fgets(line,sizeof(line),f)){
+            if(!strncmp(line,"VmHWM:",6))
+                kb=atoll(line+6);
+        }
+        fclose(f);
+        if(kb>=0)
+            return kb;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    return usage.ru_maxrss;
+}
+
+// Times f(), which does ops calls and returns a checksum. primes is how many primes it produced, or 0.
+template<class F> void bench(const char* name, unsigned long long n, unsigned long long ops, unsigned long long primes, F f){
+    fprintf(stderr,"%s(%llu)...",name,n);
+    resetPeakRSS();
+    std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+    unsigned long long check=f();
+    double seconds=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    results.push_back(BenchResult{name,n,ops,seconds,primes,peakRSS(),check});
+    fprintf(stderr," %.3f s\n",seconds);
+}
+
+// xorshift64*, so the queries don't depend on the standard library's rand
+static unsigned long long nextRandom(unsigned long long& state){
+    state^=state>>12;
+    state^=state<<25;
+    state^=state>>27;
+    return state*2685821657736338717ULL;
+}
+
+static void sizeLadder(unsigned long long n, unsigned int threads){
+    const bool small=n<=4289995710ULL;
+    unsigned long long count;
+    {
+        PrimeData pd;
+        pd.setThreads(threads);
+        bench("numPrimesUpTo",n,1,0,[&]{
+            return count=pd.numPrimesUpTo(n);
+        });
+    }
+    {
+        PrimeData pd;
+        pd.setThreads(threads);
+        bench("buildSieveTo",n,1,count,[&]{
+            pd.buildSieveTo(n);
+            return (unsigned long long)pd.isPrimeUnsafe(n);
+        });
+    }
+    if(small){
+        PrimeData pd;
+        pd.setThreads(threads);
+        bench("numPrimesUpToSmall",n,1,0,[&]{
+            return (unsigned long long)pd.numPrimesUpToSmall(n);
+        });
+    }
+    {
+        PrimeData pd;
+        pd.setThreads(threads);
+        bench("numPrimesUpToLMO",n,1,0,[&]{
+            return pd.numPrimesUpToLMO(n);
+        });
+    }
+    {
+        PrimeData pd;
+        bench("nthPrime",count,1,0,[&]{
+            return pd.nthPrime(count);
+        });
+    }
+    {
+        PrimeData pd;
+        pd.setThreads(threads);
+        unsigned long long sum=0;
+        bench("forEachPrime",n,1,count,[&]{
+            pd.forEachPrime(0,n,[&](unsigned long long p){
+                sum+=p;
+            });
+            return sum;
+        });
+    }
+    {
+        PrimeData pd;
+        pd.setThreads(threads);
+        PrimeList primes;
+        bench("primesUpTo(PrimeList)",n,1,count,[&]{
+            return pd.primesUpTo(n,primes);
+        });
+    }
+    // the vectors take 8 bytes per prime, so past 4289995710 they're left to PrimeList
+    if(small){
+        {
+            PrimeData pd;
+            pd.setThreads(threads);
+            std::vector<unsigned long long> primes;
+            bench("primesUpTo",n,1,count,[&]{
+                return pd.primesUpTo(n,primes);
+            });
+        }
+        {
+            PrimeData pd;
+            pd.setThreads(threads);
+            std::vector<unsigned int> primes;
+            bench("primesUpToSmall",n,1,count,[&]{
+                return (unsigned long long)pd.primesUpToSmall(n,primes);
+            });
+        }
+        {
+            PrimeData pd;
+            pd.setThreads(threads);
+            std::vector<unsigned long long> primes;
+            bench("firstPrimes",count,1,count,[&]{
+                pd.firstPrimes(count,primes);
+                return primes.back();
+            });
+        }
+        {
+            PrimeData pd;
+            pd.setThreads(threads);
+            std::vector<unsigned int> primes;
+            bench("firstPrimesSmall",count,1,count,[&]{
+                pd.firstPrimesSmall(count,primes);
+                return (unsigned long long)primes.back();
+            });
+        }
+    }
+}
+
+// Random queries below n, against a sieve built up to n
+static void randomQueries(unsigned long long n, unsigned int threads){
+    const unsigned int m=n<4289995710ULL ? n : 4289995710U;
+    const unsigned long long ops=1000000, slowops=20000;
+    std::vector<unsigned long long> in(ops);
+    std::vector<unsigned int> in32(ops);
+    std::vector<unsigned long long> in64(ops);
+    unsigned long long state=88172645463325252ULL;
+    for(unsigned long long i=0; i<ops; ++i){
+        in[i]=nextRandom(state)%(n+1);
+        in32[i]=nextRandom(state)%(m+1ULL);
+        in64[i]=nextRandom(state)|1;
+    }
+    PrimeData pd;
+    pd.setThreads(threads);
+    pd.buildSieveTo(n);
+    unsigned long long factors[15];
+    unsigned int factors32[10];
+    unsigned char exponents[15];
+    std::vector<unsigned char> out(ops);
+
+    bench("isPrime",n,ops,0,[&]{
+        unsigned long long t=0;
+        for(unsigned long long i=0; i<ops; ++i)
+            t+=pd.isPrime(in[i]);
+        return t;
+    });
+    bench("isPrimeUnsafe",n,ops,0,[&]{
+        unsigned long long t=0;
+        for(unsigned long long i=0; i<ops; ++i)
+            t+=pd.isPrimeUnsafe(in[i]);
+        return t;
+    });
+    bench("isPrimeSmall",m,ops,0,[&]{
+        unsigned long long t=0;
+        for(unsigned long long i=0; i<ops; ++i)
+            t+=pd.isPrimeSmall(in32[i]);
+        return t;
+    });
+    bench("isPrimeSmallUnsafe",m,ops,0,[&]{
+        unsigned long long t=0;
+        for(unsigned long long i=0; i<ops; ++i)
+            t+=pd.isPrimeSmallUnsafe(in32[i]);
+        return t;
+    });
+    bench("isPrimeBatch",n,ops,0,[&]{
+        pd.isPrimeBatch(in.data(),ops,out.data());
+        unsigned long long t=0;
+        for(unsigned long long i=0; i<ops; ++i)
+            t+=out[i];
+        return t;
+    });
+    bench("isPrimeSmallBatch",m,ops,0,[&]{
+        pd.isPrimeSmallBatch(in32.data(),ops,out.data());
+        unsigned long long t=0;
+        for(unsigned long long i=0; i<ops; ++i)
+            t+=out[i];
+        return t;
+    });
+    bench("isPrimeWheel",n,slowops,0,[&]{
+        unsigned long long t=0;
+        for(unsigned long long i=0; i<slowops; ++i)
+            t+=pd.isPrimeWheel(in[i]);
+        return t;
+    });
+    bench("isPrimeSmallWheel",m,ops,0,[&]{
+        unsigned long long t=0;
+        for(unsigned long long i=0; i<ops; ++i)
+            t+=pd.isPrimeSmallWheel(in32[i]);
+        return t;
+    });
+    // past the sieve, isPrime falls back on Miller-Rabin or Baillie-PSW
+    bench("isPrime(64-bit)",~0ULL,ops,0,[&]{
+        unsigned long long t=0;
+        for(unsigned long long i=0; i<ops; ++i)
+            t+=pd.isPrime(in64[i]);
+        return t;
+    });
+    bench("factor",n,ops,0,[&]{
+        unsigned long long t=0;
+        for(unsigned long long i=0; i<ops; ++i)
+            t+=pd.factor(in[i]|1,factors,exponents);
+        return t;
+    });
+    bench("factorUnsafe",n,ops,0,[&]{
+        unsigned long long t=0;
+        for(unsigned long long i=0; i<ops; ++i)
+            t+=pd.factorUnsafe(in[i]|1,factors,exponents);
+        return t;
+    });
+    bench("factorWheel",n,slowops,0,[&]{
+        unsigned long long t=0;
+        for(unsigned long long i=0; i<slowops; ++i)
+            t+=pd.factorWheel(in[i]|1,factors,exponents);
+        return t;
+    });
+    bench("factorSmall",m,ops,0,[&]{
+        unsigned long long t=0;
+        for(unsigned long long i=0; i<ops; ++i)
+            t+=pd.factorSmall(in32[i]|1,factors32,exponents);
+        return t;
+    });
+    bench("factorSmallUnsafe",m,ops,0,[&]{
+        unsigned long long t=0;
+        for(unsigned long long i=0; i<ops; ++i)
+            t+=pd.factorSmallUnsafe(in32[i]|1,factors32,exponents);
+        return t;
+    });
+    bench("factorSmallWheel",m,slowops,0,[&]{
+        unsigned long long t=0;
+        for(unsigned long long i=0; i<slowops; ++i)
+            t+=pd.factorSmallWheel(in32[i]|1,factors32,exponents);
+        return t;
+    });
+    bench("buildRankIndex",n,1,0,[&]{
+        pd.buildRankIndex();
+        return 0ULL;
+    });
+    bench("numPrimesUpTo(ranked)",n,ops,0,[&]{
+        unsigned long long t=0;
+        for(unsigned long long i=0; i<ops; ++i)
+            t+=pd.numPrimesUpTo(in[i]);
+        return t;
+    });
+}
+
+int main(int argc, char** argv){
+    unsigned long long max=argc>1 ? strtoull(argv[1],0,10) : 1000000000ULL;
+    unsigned int threads=argc>2 ? atoi(argv[2]) : 1;
+    const unsigned long long ladder[6]={1000000000ULL,2000000000ULL,4289995710ULL,5000000000ULL,10000000000ULL,15000000000ULL};
+    for(unsigned int i=0; i<6; ++i){
+        if(ladder[i]<=max)
+            sizeLadder(ladder[i],threads);
+    }
+    randomQueries(std::min(max,4289995710ULL),threads);
+
+    printf("{\n");
+    printf("  \"compiler\": \"%s\",\n",__VERSION__);
+    printf("  \"threads\": %u,\n",threads);
+    printf("  \"cores\": %u,\n",std::thread::hardware_concurrency());
+    printf("  \"results\": [\n");
+    for(size_t i=0; i<results.size(); ++i){
+        const BenchResult& r=results[i];
+        printf("    {\"name\": \"%s\", \"n\": %llu, \"ops\": %llu, \"seconds\": %.6f, \"ns_per_op\": %.2f, ",
+            r.name.c_str(),r.n,r.ops,r.seconds,r.seconds*1e9/r.ops);
+        if(r.primes)
+            printf("\"primes_per_second\": %.0f, ",r.primes/r.seconds);
+        printf("\"peak_rss_kb\": %lld, \"check\": %llu}%s\n",r.peakKB,r.check,i+1<results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+    return 0;
+}